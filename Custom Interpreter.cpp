@@ -1,304 +1,146 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
-#include <map>
 #include <vector>
-#include <stdexcept>
-#include <cctype>
 
+#include <unistd.h>
 
-class Interpreter {
-    struct Function {
-        std::vector<std::string> parameters;
-        std::string body;
-    };
+#include "bytecodeCompiler.h"
+#include "interpreter.h"
+#include "scriptService.h"
 
-    std::string input;
-    size_t pos;
-    char current_char;
-    std::map<std::string, int> variables;
-    std::map<std::string, Function> functions;
-    std::map<std::string, std::vector<int>> arrays;
-
-    void error(const std::string& msg) {
-        throw std::runtime_error("Error: " + msg);
-    }
-
-    void advance() {
-        pos++;
-        if (pos < input.length())
-            current_char = input[pos];
-        else
-            current_char = '\0';  // End of input
-    }
-
-    void skip_whitespace() {
-        while (current_char != '\0' && isspace(current_char)) {
-            advance();
-        }
-    }
-
-    int integer() {
-        std::string result;
-        while (current_char != '\0' && isdigit(current_char)) {
-            result += current_char;
-            advance();
-        }
-        return std::stoi(result);
-    }
-
-    std::string identifier() {
-        std::string result;
-        while (current_char != '\0' && (isalnum(current_char) || current_char == '_')) {
-            result += current_char;
-            advance();
-        }
-        return result;
-    }
-
-    int factor() {
-        skip_whitespace();
-        if (isdigit(current_char)) {
-            return integer();
-        } else if (isalpha(current_char)) {
-            std::string var_name = identifier();
-            if (current_char == '[') {  // Array access
-                advance();
-                int index = expr();
-                if (current_char != ']') error("Expected ']' for array access");
-                advance();
-                if (arrays.count(var_name)) {
-                    if (index < 0 || index >= arrays[var_name].size()) error("Array index out of bounds");
-                    return arrays[var_name][index];
-                } else {
-                    error("Undefined array: " + var_name);
-                }
-            } else if (variables.count(var_name)) {  // Variable access
-                return variables[var_name];
-            } else if (functions.count(var_name)) {  // Function call
-                return call_function(var_name);
-            } else {
-                error("Undefined variable or function: " + var_name);
-            }
-        } else if (current_char == '(') {
-            advance();
-            int result = expr();
-            if (current_char != ')') error("Expected ')'");
-            advance();
-            return result;
-        } else {
-            error("Invalid factor");
-        }
-        return 0;  // Should never reach here
-    }
-
-    int term() {
-        int result = factor();
-        while (current_char == '*' || current_char == '/') {
-            char op = current_char;
-            advance();
-            if (op == '*')
-                result *= factor();
-            else
-                result /= factor();
-        }
-        return result;
-    }
-
-    int expr() {
-        int result = term();
-        while (current_char == '+' || current_char == '-') {
-            char op = current_char;
-            advance();
-            if (op == '+')
-                result += term();
-            else
-                result -= term();
-        }
-        return result;
-    }
-
-    void block() {
-        skip_whitespace();
-        if (current_char != '{') error("Expected '{' to start block");
-        advance();
-        while (current_char != '\0' && current_char != '}') {
-            statement();
-            skip_whitespace();
-            if (current_char == ';') advance();
+// Call chunk(data, length) for each block of stdin until end of file.
+// read() returns what is available, so a terminal or a slow pipe is served
+// line by line and a file in large chunks. Returns false on a read error.
+template <typename Chunk>
+bool readInput(Chunk chunk) {
+    std::string buffer(1 << 16, '\0');
+    while (true) {
+        ssize_t length = ::read(STDIN_FILENO, &buffer[0], buffer.size());
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            std::perror("read");
+            return false;
         }
-        if (current_char != '}') error("Expected '}' to end block");
-        advance();
+        if (length == 0) return true;
+        chunk(buffer.data(), static_cast<size_t>(length));
     }
+}
 
-    int call_function(const std::string& func_name) {
-        if (!functions.count(func_name)) error("Undefined function: " + func_name);
-
-        Function func = functions[func_name];
-        skip_whitespace();
-
-        if (current_char != '(') error("Expected '(' for function call");
-        advance();
-
-        std::vector<int> args;
-        for (const auto& param : func.parameters) {
-            if (args.size() > 0) {
-                if (current_char != ',') error("Expected ',' between function arguments");
-                advance();
-            }
-            args.push_back(expr());
-        }
-
-        if (current_char != ')') error("Expected ')' after function arguments");
-        advance();
-
-        std::map<std::string, int> saved_variables = variables;
-        for (size_t i = 0; i < func.parameters.size(); i++) {
-            variables[func.parameters[i]] = args[i];
-        }
-
-        size_t saved_pos = pos;
-        std::string saved_input = input;
-
-        input = func.body;
-        pos = 0;
-        current_char = input[pos];
-
-        int result = 0;
-        try {
-            result = expr();
-        } catch (...) {
-            input = saved_input;
-            pos = saved_pos;
-            current_char = input[pos];
-            variables = saved_variables;
-            throw;
+// Run each line of stdin as a separate script on a ScriptService, printing
+// "<line> ok [result=<value>] <microseconds>" or "<line> <error>" as each
+// finishes and latency percentiles at the end
+int serve(const char* preludePath) {
+    std::string prelude;
+    if (preludePath) {
+        std::ifstream in(preludePath);
+        if (!in) {
+            std::cerr << "Cannot open " << preludePath << std::endl;
+            return 1;
         }
-
-        input = saved_input;
-        pos = saved_pos;
-        current_char = input[pos];
-        variables = saved_variables;
-
-        return result;
+        std::stringstream text;
+        text << in.rdbuf();
+        prelude = text.str();
     }
 
-    void statement() {
-        skip_whitespace();
-        if (current_char == '\0') return;
-
-        if (isalpha(current_char)) {
-            std::string id = identifier();
-            skip_whitespace();
-            if (current_char == '=') {  // Variable assignment
-                advance();
-                int value = expr();
-                variables[id] = value;
-            } else if (current_char == '(') {  // Function call
-                call_function(id);
-            } else if (current_char == '[') {  // Array assignment
-                advance();
-                int index = expr();
-                if (current_char != ']') error("Expected ']' for array assignment");
-                advance();
-                skip_whitespace();
-                if (current_char != '=') error("Expected '=' for array assignment");
-                advance();
-                int value = expr();
-                if (arrays.count(id)) {
-                    if (index < 0 || index >= arrays[id].size()) error("Array index out of bounds");
-                    arrays[id][index] = value;
+    std::mutex outputLock;
+    std::vector<int64_t> latencies;  // Microseconds from submission to completion
+    size_t failures = 0;
+    try {
+        ScriptService service(prelude);
+        size_t lineNumber = 0;
+        std::string line;
+        auto submit = [&] {
+            ++lineNumber;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) return;
+            service.submit(line, [&, id = lineNumber](const Interpreter& interpreter, const ScriptReport& report) {
+                using std::chrono::microseconds;
+                int64_t ran = std::chrono::duration_cast<microseconds>(report.ran).count();
+                std::ostringstream out;
+                out << id << '\t';
+                if (!report.error.empty()) {
+                    out << report.error;
                 } else {
-                    error("Undefined array: " + id);
-                }
-            } else {
-                error("Invalid statement");
-            }
-        } else if (current_char == 'f') {  // Function declaration
-            advance();
-            std::string keyword = identifier();
-            if (keyword == "function") {
-                std::string func_name = identifier();
-                skip_whitespace();
-                if (current_char != '(') error("Expected '(' for function declaration");
-                advance();
-
-                std::vector<std::string> parameters;
-                if (current_char != ')') {
-                    while (true) {
-                        parameters.push_back(identifier());
-                        if (current_char == ')') break;
-                        if (current_char != ',') error("Expected ',' between parameters");
-                        advance();
+                    out << "ok";
+                    try {
+                        int result = interpreter.get_variable("result");  // Before the label, as it may throw
+                        out << " result=" << result;
+                    } catch (const std::out_of_range&) {
                     }
+                    out << '\t' << ran << "us";
                 }
-                advance();
-
-                skip_whitespace();
-                std::string body = "";
-                if (current_char != '{') error("Expected '{' for function body");
-                advance();
-                while (current_char != '\0' && current_char != '}') {
-                    body += current_char;
-                    advance();
+                std::lock_guard<std::mutex> guard(outputLock);
+                std::cout << out.str() << '\n';
+                latencies.push_back(std::chrono::duration_cast<microseconds>(report.queued + report.ran).count());
+                if (!report.error.empty()) ++failures;
+            });
+            line.clear();
+        };
+        bool complete = readInput([&](const char* data, size_t length) {
+            for (size_t i = 0; i < length; ++i) {
+                if (data[i] == '\n') {
+                    submit();
+                } else {
+                    line += data[i];
                 }
-                if (current_char != '}') error("Expected '}' to end function body");
-                advance();
-
-                functions[func_name] = {parameters, body};
-            } else {
-                error("Unknown keyword: " + keyword);
-            }
-        } else if (current_char == 'a') {  // Array declaration
-            advance();
-            std::string keyword = identifier();
-            if (keyword == "array") {
-                std::string array_name = identifier();
-                skip_whitespace();
-                if (current_char != '[') error("Expected '[' for array declaration");
-                advance();
-                int size = expr();
-                if (current_char != ']') error("Expected ']' after array size");
-                advance();
-                arrays[array_name] = std::vector<int>(size);
-            } else {
-                error("Unknown keyword: " + keyword);
             }
-        } else {
-            error("Unknown statement");
-        }
+        });
+        submit();
+        service.wait();
+        if (!complete) return 1;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 
-    void program() {
-        while (current_char != '\0') {
-            statement();
-            skip_whitespace();
-            if (current_char == ';') {
-                advance();
-            } else if (current_char != '\0') {
-                error("Expected ';' after statement");
-            }
-        }
-    }
+    std::cout.flush();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t p) { return latencies.empty() ? 0 : latencies[(latencies.size() - 1) * p / 100]; };
+    std::cerr << latencies.size() << " scripts, " << failures << " failed; latency p50 " << percentile(50)
+              << "us, p99 " << percentile(99) << "us, max " << percentile(100) << "us" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
 
-public:
-    void interpret(const std::string& text) {
-        input = text;
-        pos = 0;
-        current_char = input[pos];
-        try {
-            program();
-        } catch (const std::exception& e) {
-            std::cerr << e.what() << std::endl;
-        }
+int main(int argc, char* argv[]) {
+    // interpreter:       run the program with the tree-walking Interpreter
+    // interpreter --vm:  compile it to VM bytecode and run that instead; an
+    //                    expression needing more than VM_REGISTERS temporaries
+    //                    (e.g. 31 nested calls) does not compile
+    // interpreter -S:    print the VM bytecode it compiles to
+    // interpreter --stream: run each statement of stdin as it arrives, until EOF
+    // interpreter --serve [prelude]: run each line of stdin as its own script,
+    //                    concurrently, after the declarations in prelude
+    std::string mode = argc > 1 ? argv[1] : "";
+    bool serving = mode == "--serve" && argc <= 3;
+    if (!serving && (argc > 2 || (!mode.empty() && mode != "--vm" && mode != "-S" && mode != "--stream"))) {
+        std::cerr << "Usage: " << argv[0] << " [--vm | -S | --stream | --serve [prelude]]\n"
+                  << "  --vm runs on the VM, where an expression may need at most " << registerCount
+                  << " registers" << std::endl;
+        return 2;
+    }
+    if (serving) {
+        return serve(argc == 3 ? argv[2] : nullptr);
     }
-};
 
-int main() {
     Interpreter interpreter;
     std::string code;
 
-    std::cout << "Enter your program (end with an empty line):" << std::endl;
+    if (mode == "--stream") {
+        bool complete = readInput([&](const char* data, size_t length) {
+            interpreter.feed(std::string_view(data, length));
+        });
+        interpreter.finish();
+        return complete ? 0 : 1;
+    }
+
+    if (mode != "-S") {
+        std::cout << "Enter your program (end with an empty line):" << std::endl;
+    }
     while (true) {
         std::string line;
         std::getline(std::cin, line);
@@ -306,8 +148,27 @@ int main() {
         code += line + " ";
     }
 
-    std::cout << "Executing program...\n";
-    interpreter.interpret(code);
+    if (mode.empty()) {
+        std::cout << "Executing program...\n";
+        interpreter.interpret(code);
+        return 0;
+    }
 
+    try {
+        CompiledScript script = BytecodeCompiler().compile(code);
+        if (mode == "-S") {
+            for (const std::string& line : script.assembly) {
+                std::cout << line << '\n';
+            }
+            return 0;
+        }
+        std::cout << "Executing program...\n";
+        VirtualMachine vm(script.static_cells + BytecodeCompiler::defaultArrayCells);
+        vm.setMaxCallDepth(BytecodeCompiler::defaultCallDepth);
+        script.run(vm);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
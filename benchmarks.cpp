@@ -0,0 +1,329 @@
+// Micro-benchmarks for the VM and the Interpreter (Google Benchmark).
+//
+//   g++ -std=c++17 -O2 benchmarks.cpp -lbenchmark -lpthread -o benchmarks
+//   ./benchmarks --benchmark_filter=Vm
+//
+// VM workloads report executed instructions as items, so the output shows
+// instructions/sec (items_per_second) and seconds per instruction. Interpreter
+// workloads, tree-walking or compiled to VM bytecode, report one item per
+// statement evaluated.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "bytecodeCompiler.h"
+#include "interpreter.h"
+#include "scriptService.h"
+#include "virtualMachine.h"
+
+namespace {
+
+// Assemble a text program once per benchmark. It is not optimised, so the
+// instruction counts below stay exact.
+std::shared_ptr<const Program> assemble(const std::vector<std::string>& source) {
+    auto program = std::make_shared<Program>();
+    program->load(source);
+    return program;
+}
+
+// Run program repeatedly; instructionsPerRun is what one run executes.
+// state.range(0) selects tiered JIT execution.
+void runVm(benchmark::State& state, const std::shared_ptr<const Program>& program, int64_t instructionsPerRun,
+           size_t heapSize = VirtualMachine::defaultHeapSize) {
+    VirtualMachine vm(program, heapSize);
+    StringSink output;
+    vm.setOutput(output);
+    vm.setTiered(state.range(0) != 0);
+    for (auto _ : state) {
+        if (vm.start() != Trap::None) {
+            state.SkipWithError(trapMessage(vm.lastTrap()));
+            break;
+        }
+        benchmark::DoNotOptimize(vm.getRegister(0));
+    }
+    state.SetItemsProcessed(state.iterations() * instructionsPerRun);
+    state.counters["time/instruction"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * instructionsPerRun),
+        benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+constexpr int loopIterations = 100000;
+
+// Counted loop of ALU work: R4 += (3 * R0) % 7
+void BM_VmArithmeticLoop(benchmark::State& state) {
+    auto program = assemble({
+        "MOV R0 0", "MOV R1 1", "MOV R2 " + std::to_string(loopIterations), "MOV R4 0", "MOV R5 7",
+        "loop:",
+        "ADD R0 R1", "MOV R3 3", "MUL R3 R0", "MOD R3 R5", "ADD R4 R3",
+        "JEQ R0 R2 done", "JMP loop",
+        "done:"
+    });
+    // 5 setup instructions, 7 per iteration, no JMP after the last
+    runVm(state, program, 5 + int64_t(loopIterations) * 7 - 1);
+}
+BENCHMARK(BM_VmArithmeticLoop)->Arg(0)->Arg(1);
+
+constexpr int callDepth = 1000;
+constexpr int callRepeats = 100;
+
+// Recursive CALL/RET: sum(n) = n + sum(n - 1), callRepeats times
+void BM_VmRecursiveCall(benchmark::State& state) {
+    auto program = assemble({
+        "MOV R2 0", "MOV R3 1", "MOV R4 0", "MOV R5 " + std::to_string(callRepeats),
+        "again:",
+        "MOV R0 " + std::to_string(callDepth), "MOV R1 0",
+        "CALL sum",
+        "ADD R4 R3", "JEQ R4 R5 end", "JMP again",
+        "sum:",
+        "JEQ R0 R2 base", "ADD R1 R0", "SUB R0 R3", "CALL sum", "RET",
+        "base:",
+        "RET",
+        "end:"
+    });
+    // Per repeat: MOV, MOV, CALL, ADD, JEQ, JMP around 5 instructions per
+    // level and JEQ+RET at the bottom; no JMP after the last repeat
+    const int64_t perRepeat = 6 + 5 * int64_t(callDepth) + 2;
+    runVm(state, program, 4 + callRepeats * perRepeat - 1);
+}
+BENCHMARK(BM_VmRecursiveCall)->Arg(0)->Arg(1);
+
+constexpr int sweepCells = 4096;
+constexpr int sweepPasses = 16;
+
+// Write then read back every heap cell, sweepPasses times
+void BM_VmHeapSweep(benchmark::State& state) {
+    auto program = assemble({
+        "MOV R1 1", "MOV R2 " + std::to_string(sweepCells), "MOV R4 0", "MOV R5 " + std::to_string(sweepPasses),
+        "pass:",
+        "MOV R0 0",
+        "write:",
+        "STORE R0 [R0+0]", "ADD R0 R1", "JEQ R0 R2 read", "JMP write",
+        "read:",
+        "MOV R0 0",
+        "readNext:",
+        "LOAD R3 [R0+0]", "ADD R0 R1", "JEQ R0 R2 next", "JMP readNext",
+        "next:",
+        "ADD R4 R1", "JEQ R4 R5 end", "JMP pass",
+        "end:"
+    });
+    // Per pass: two sweeps of 4 instructions per cell (minus the final JMP)
+    // plus MOV, MOV and the 3-instruction pass loop
+    const int64_t perPass = 8 * int64_t(sweepCells) + 3;
+    runVm(state, program, 4 + sweepPasses * perPass - 1, sweepCells);
+}
+BENCHMARK(BM_VmHeapSweep)->Arg(0)->Arg(1);
+
+// Interpret source repeatedly in a fresh Interpreter; statements is the
+// number of top-level statements it contains
+void runInterpreter(benchmark::State& state, const std::string& source, int64_t statements) {
+    for (auto _ : state) {
+        Interpreter interpreter;
+        interpreter.interpret(source);
+        benchmark::DoNotOptimize(interpreter.get_variable("result"));
+    }
+    state.SetItemsProcessed(state.iterations() * statements);
+}
+
+// A parenthesised expression nested state.range(0) levels deep
+void BM_InterpreterDeepExpression(benchmark::State& state) {
+    std::string expression = "1";
+    for (int64_t level = 0; level < state.range(0); ++level) {
+        expression = "(" + expression + "+" + std::to_string(level % 7) + ")*1";
+    }
+    runInterpreter(state, "result=" + expression, 1);
+}
+BENCHMARK(BM_InterpreterDeepExpression)->Arg(16)->Arg(256);
+
+// Nested calls through three levels of user functions, unrolled at top level
+void BM_InterpreterFunctionCalls(benchmark::State& state) {
+    std::string source = "function sq(a){a*a}; function norm(a,b){sq(a)+sq(b)}; "
+                         "function poly(x){norm(x,x+1)-norm(x-1,x)}; result=0";
+    const int calls = static_cast<int>(state.range(0));
+    for (int i = 0; i < calls; ++i) {
+        source += "; result=result+poly(" + std::to_string(i % 50) + ")";
+    }
+    runInterpreter(state, source, calls + 4);
+}
+BENCHMARK(BM_InterpreterFunctionCalls)->Arg(100);
+
+// Fill an array and sum it back with one generated statement per element, so
+// parsing dominates; BM_InterpreterLoop is the same work as a loop
+std::string arraySweepSource(int size) {
+    std::string source = "array data[" + std::to_string(size) + "]";
+    for (int i = 0; i < size; ++i) {
+        source += "; data[" + std::to_string(i) + "]=" + std::to_string(i) + "*3";
+    }
+    source += "; result=0";
+    for (int i = 0; i < size; ++i) {
+        source += "; result=result+data[" + std::to_string(i) + "]";
+    }
+    return source;
+}
+
+void BM_InterpreterArraySweep(benchmark::State& state) {
+    const int size = static_cast<int>(state.range(0));
+    runInterpreter(state, arraySweepSource(size), 2 * int64_t(size) + 2);
+}
+BENCHMARK(BM_InterpreterArraySweep)->Arg(256);
+
+// BM_InterpreterArraySweep streamed through feed() in state.range(0)-byte
+// chunks, as "interpreter --stream" reads a pipe
+void BM_InterpreterFeed(benchmark::State& state) {
+    const int size = 256;
+    const std::string source = arraySweepSource(size);
+    const size_t chunk = static_cast<size_t>(state.range(0));
+    for (auto _ : state) {
+        Interpreter interpreter;
+        for (size_t i = 0; i < source.size(); i += chunk) {
+            interpreter.feed(std::string_view(source).substr(i, chunk));
+        }
+        interpreter.finish();
+        benchmark::DoNotOptimize(interpreter.get_variable("result"));
+    }
+    state.SetItemsProcessed(state.iterations() * (2 * int64_t(size) + 2));
+}
+BENCHMARK(BM_InterpreterFeed)->Arg(64)->Arg(65536);
+
+// BM_InterpreterArraySweep written with for loops. Two statements run per
+// iteration of each loop (body and step) plus the assignments, declaration
+// and loop initializers.
+std::string loopSource(int size) {
+    return "n=" + std::to_string(size) + "; array data[n]; "
+           "for (i=0; i<n; i=i+1) { data[i]=i*3 }; result=0; "
+           "for (i=0; i<n; i=i+1) { result=result+data[i] }";
+}
+
+int64_t loopStatements(int size) {
+    return 4 * int64_t(size) + 5;
+}
+
+void BM_InterpreterLoop(benchmark::State& state) {
+    const int size = static_cast<int>(state.range(0));
+    runInterpreter(state, loopSource(size), loopStatements(size));
+}
+BENCHMARK(BM_InterpreterLoop)->Arg(256)->Arg(4096);
+
+// Whole-array builtins over two arrays: fill, copy, dot and sum each
+// touch every element once, counted as items
+std::string builtinSource(int size) {
+    return "n=" + std::to_string(size) + "; array a[n]; array b[n]; "
+           "fill(a, 3); copy(b, a); result=dot(a, b)+sum(b)";
+}
+
+void BM_InterpreterBuiltins(benchmark::State& state) {
+    const int size = static_cast<int>(state.range(0));
+    runInterpreter(state, builtinSource(size), 4 * int64_t(size));
+}
+BENCHMARK(BM_InterpreterBuiltins)->Arg(4096);
+
+// Doubly recursive Fibonacci, exercising calls, returns and conditionals.
+// fib(n) makes 2 * F(n + 1) - 1 calls, each running an if and a return.
+std::string recursionSource(int n) {
+    return "function fib(n) { if (n < 2) { return n }; return fib(n-1) + fib(n-2) }; "
+           "result=fib(" + std::to_string(n) + ")";
+}
+
+int64_t recursionStatements(int n) {
+    int64_t previous = 0, fib = 1;
+    for (int i = 0; i < n; ++i) {
+        int64_t next = previous + fib;
+        previous = fib;
+        fib = next;
+    }
+    return 2 * (2 * fib - 1) + 1;
+}
+
+void BM_InterpreterRecursion(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    runInterpreter(state, recursionSource(n), recursionStatements(n));
+}
+BENCHMARK(BM_InterpreterRecursion)->Arg(15);
+
+// The same Fibonacci as a memo function: each fib(k) runs its body once
+void BM_InterpreterMemoRecursion(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    runInterpreter(state, "memo " + recursionSource(n), 2 * (int64_t(n) + 1));
+}
+BENCHMARK(BM_InterpreterMemoRecursion)->Arg(15)->Arg(40);
+
+// The same scripts compiled once to VM bytecode and run on the VM;
+// state.range(1) selects tiered JIT execution. The heap is sized to the
+// script, since every run zeroes it.
+void runCompiled(benchmark::State& state, const std::string& source, int64_t statements, size_t arrayCells) {
+    CompiledScript script = BytecodeCompiler().compile(source);
+    VirtualMachine vm(script.static_cells + arrayCells);
+    vm.setMaxCallDepth(BytecodeCompiler::defaultCallDepth);
+    vm.setTiered(state.range(1) != 0);
+    for (auto _ : state) {
+        script.run(vm);
+        benchmark::DoNotOptimize(script.get_variable(vm, "result"));
+    }
+    state.SetItemsProcessed(state.iterations() * statements);
+}
+
+void BM_CompiledLoop(benchmark::State& state) {
+    const int size = static_cast<int>(state.range(0));
+    runCompiled(state, loopSource(size), loopStatements(size), size);
+}
+BENCHMARK(BM_CompiledLoop)->Args({4096, 0})->Args({4096, 1});
+
+void BM_CompiledRecursion(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    runCompiled(state, recursionSource(n), recursionStatements(n), 0);
+}
+BENCHMARK(BM_CompiledRecursion)->Args({15, 0})->Args({15, 1});
+
+void BM_CompiledBuiltins(benchmark::State& state) {
+    const int size = static_cast<int>(state.range(0));
+    runCompiled(state, builtinSource(size), 4 * int64_t(size), 2 * size_t(size));
+}
+BENCHMARK(BM_CompiledBuiltins)->Args({4096, 0})->Args({4096, 1});
+
+// Many small scripts sharing a prelude of declarations, as a script server
+// sees them: each iteration runs serviceScripts of them
+constexpr int serviceScripts = 256;
+const char* const servicePrelude = "function sq(a){a*a}; function norm(a,b){sq(a)+sq(b)}; "
+                                   "function poly(x){norm(x,x+1)-norm(x-1,x)}";
+
+std::string serviceScript(int i) {
+    return "x=" + std::to_string(i % 50) + "; result=poly(x)+norm(x,3)";
+}
+
+// Baseline: a new Interpreter per script, running the prelude every time
+void BM_ScriptsFreshInterpreter(benchmark::State& state) {
+    for (auto _ : state) {
+        for (int i = 0; i < serviceScripts; ++i) {
+            Interpreter interpreter;
+            interpreter.interpret(servicePrelude);
+            interpreter.interpret(serviceScript(i));
+            benchmark::DoNotOptimize(interpreter.get_variable("result"));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * serviceScripts);
+}
+BENCHMARK(BM_ScriptsFreshInterpreter);
+
+// ScriptService with state.range(0) threads: pooled Interpreters reset to the prelude
+void BM_ScriptService(benchmark::State& state) {
+    ScriptService service(servicePrelude, static_cast<unsigned>(state.range(0)));
+    std::vector<std::string> scripts;
+    for (int i = 0; i < serviceScripts; ++i) {
+        scripts.push_back(serviceScript(i));
+    }
+    for (auto _ : state) {
+        for (const std::string& script : scripts) {
+            service.submit(script, [](const Interpreter& interpreter, const ScriptReport&) {
+                benchmark::DoNotOptimize(interpreter.get_variable("result"));
+            });
+        }
+        service.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * serviceScripts);
+}
+BENCHMARK(BM_ScriptService)->Arg(1)->Arg(4)->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,871 @@
+#ifndef BYTECODE_COMPILER_H
+#define BYTECODE_COMPILER_H
+
+// Lowers Interpreter programs to VirtualMachine bytecode, so scripts run on
+// the VM's dispatch loop, optimizer, JIT and profiler.
+//
+// Heap layout: cell 0 is the array allocation pointer, then one cell per
+// global variable and a (base, size) pair per array name. Arrays are
+// bump-allocated above those at run time, so the VM needs static_cells plus
+// room for every array a script declares.
+//
+// Registers: R0 carries return values. In a function, R1..Rn hold the
+// parameters and R<n+1> the value of the last expression statement, with
+// expression temporaries above. Top-level code keeps the globals it uses in
+// R1 upwards instead, writing them back to their cells around calls and at
+// the end. A call evaluates its arguments into temporaries, saves
+// everything below them with a CALL register window and goes through a
+// small out-of-line stub that moves the arguments down to R1..Rn before
+// jumping to the function.
+//
+// Temporaries are never spilled to the heap. Operands that cannot fail or
+// have effects are evaluated deepest first, which keeps e.g. right-nested
+// sums within two registers, but an expression that still needs more than
+// VM_REGISTERS (32 by default), such as 31 nested calls in top-level code,
+// is a compile error.
+//
+// The array builtins lower to MEMSET, MEMCPY or a pointer loop over the
+// cells. An array that is never declared has size 0 rather than raising
+// "Undefined array".
+// Memo functions compile like any other; the VM does not cache results. A
+// memo function that calls one changing a global or array is rejected at
+// compile time, where the Interpreter rejects it on its first call.
+//
+// Values live in 64-bit registers and 32-bit heap cells, so arithmetic that
+// overflows int may give different results than the tree-walking
+// Interpreter. Reading a global that is never assigned anywhere is a compile
+// error; reading one that is assigned later yields 0. A top-level call that
+// could reach a function declared after it is a compile error too, where
+// the Interpreter fails only if the call runs.
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "interpreter.h"
+#include "virtualMachine.h"
+
+struct CompiledScript {
+    std::shared_ptr<Program> program;
+    std::vector<std::string> assembly;  // Text bytecode the program was assembled from
+    std::unordered_map<std::string, int> globals;  // Global variable -> heap cell
+    std::unordered_map<std::string, std::string> errors;  // Error stub label -> message
+    size_t static_cells = 0;  // Heap cells in use before any array is declared
+
+    // Interpreter error message for a run that stopped with trap at pc
+    std::string error_message(Trap trap, int pc) const {
+        switch (trap) {
+            case Trap::DivisionByZero: return "Error: Division by zero";
+            case Trap::CallStackOverflow: return "Error: Maximum call depth exceeded";
+            case Trap::InvalidRange: return "Error: Array does not fit in the VM heap";
+            default: break;
+        }
+        for (const auto& label : program->symbols()) {
+            auto error = errors.find(label.first);
+            if (label.second == pc && error != errors.end()) return "Error: " + error->second;
+        }
+        return std::string("Error: ") + trapMessage(trap);
+    }
+
+    // Run on vm from a clean state, throwing runtime_error on failure. The
+    // VM needs at least static_cells heap cells.
+    void run(VirtualMachine& vm) const {
+        vm.attach(program);
+        vm.reset();
+        if (vm.start() != Trap::None) throw std::runtime_error(error_message(vm.lastTrap(), vm.getPc()));
+    }
+
+    // Value of a global variable after run()
+    int get_variable(const VirtualMachine& vm, const std::string& name) const {
+        auto it = globals.find(name);
+        if (it == globals.end()) throw std::out_of_range("Undefined variable: " + name);
+        return vm.getMemory(it->second);
+    }
+};
+
+class BytecodeCompiler {
+    // Register use of the function being generated
+    struct Frame {
+        int result = -1;  // Register of the last expression value, -1 at top level
+        int top = 1;      // Next free register
+        std::unordered_map<int, int> globals;  // Interned name -> register caching its cell
+    };
+
+    // A call whose argument move stub is emitted after the current function
+    struct Stub {
+        std::string label;
+        std::string function;
+        int first = 0;  // First argument register
+        int count = 0;
+    };
+
+    Interpreter front_end;
+    Interpreter::Parsed parsed;
+    std::vector<std::string> out;
+    std::unordered_map<int, int> variable_cells;  // Interned name -> heap cell
+    std::unordered_map<int, int> array_cells;     // Interned name -> base cell, size follows
+    std::unordered_map<int, size_t> function_index;  // Interned name -> entry in parsed.functions
+    std::unordered_set<int> assigned;  // Globals assigned anywhere in the program
+    std::unordered_map<std::string, std::string> size_errors;  // Size mismatch stub label -> message
+    std::vector<Stub> stubs;
+    Frame frame;
+    int labels = 0;
+
+    static constexpr int heap_top_cell = 0;
+
+    [[noreturn]] void error(const std::string& msg) {
+        throw std::runtime_error("Error: " + msg);
+    }
+
+    const std::string& name(int id) const {
+        return front_end.names[id];
+    }
+
+    std::string new_label() {
+        return "_L" + std::to_string(labels++);
+    }
+
+    static std::string reg(int r) {
+        return "R" + std::to_string(r);
+    }
+
+    void emit(const std::string& line) {
+        out.push_back(line);
+    }
+
+    void label(const std::string& name) {
+        out.push_back(name + ":");
+    }
+
+    int allocate() {
+        if (frame.top >= registerCount) error("Expression needs more than " + std::to_string(registerCount) + " VM registers");
+        return frame.top++;
+    }
+
+    // Address every global and array the program touches, and note which
+    // globals are ever assigned
+    void collect(const Interpreter::Code& code) {
+        for (const Interpreter::Node& node : code.nodes) {
+            if (node.kind == Interpreter::Node::VARIABLE && !variable_cells.count(node.value)) {
+                variable_cells.emplace(node.value, 0);
+            } else if (node.kind == Interpreter::Node::ARRAY) {
+                array_cells.emplace(node.value, 0);
+            } else if (node.kind == Interpreter::Node::BUILTIN) {
+                array_cells.emplace(code.arguments[node.left], 0);
+                if (node.value != Interpreter::FILL_BUILTIN && node.value != Interpreter::SUM_BUILTIN) {
+                    array_cells.emplace(code.arguments[node.left + 1], 0);
+                }
+            }
+        }
+        for (const Interpreter::Statement& statement : code.statements) {
+            if (statement.kind == Interpreter::Statement::ASSIGN) {
+                variable_cells.emplace(statement.target, 0);
+                assigned.insert(statement.target);
+            } else if (statement.kind == Interpreter::Statement::STORE ||
+                       statement.kind == Interpreter::Statement::DECLARE_ARRAY) {
+                array_cells.emplace(statement.target, 0);
+            }
+        }
+    }
+
+    // Register that already holds a parameter or cached global, or -1
+    int resident(const Interpreter::Node& node) const {
+        if (node.kind == Interpreter::Node::LOCAL) return 1 + node.value;
+        if (node.kind == Interpreter::Node::VARIABLE) {
+            auto cached = frame.globals.find(node.value);
+            if (cached != frame.globals.end() && assigned.count(node.value)) return cached->second;
+        }
+        return -1;
+    }
+
+    // Value of node index in a register the caller must not modify, either
+    // where it already lives or a fresh temporary
+    int operand(const Interpreter::Code& code, int index) {
+        int r = resident(code.nodes[index]);
+        return r >= 0 ? r : expression(code, index);
+    }
+
+    // Move cached globals to or from their heap cells
+    void spill(const char* op) {
+        for (const auto& global : frame.globals) {
+            emit(op + (" " + reg(global.second) + " ") + std::to_string(variable_cells.at(global.first)));
+        }
+    }
+
+    // Copy src into a fresh temporary
+    int copy(int src) {
+        int r = allocate();
+        emit("MOV " + reg(r) + " 0");
+        emit("ADD " + reg(r) + " " + reg(src));
+        return r;
+    }
+
+    // Jump to the out-of-bounds error stub unless 0 <= index < size of array.
+    // Each test is a GT and JEQ the optimizer fuses into one GTJEQ.
+    void check_bounds(int array, int index) {
+        int zero = allocate();
+        int test = allocate();
+        emit("MOV " + reg(zero) + " 0");
+        emit("LOAD " + reg(test) + " " + std::to_string(array_cells.at(array) + 1));
+        emit("GT " + reg(test) + " " + reg(index));
+        emit("JEQ " + reg(test) + " " + reg(zero) + " _bounds");
+        emit("GT " + reg(zero) + " " + reg(index));  // test is 1 here
+        emit("JEQ " + reg(zero) + " " + reg(test) + " _bounds");
+        frame.top = zero;
+    }
+
+    // VM opcode computing Ra = Ra <kind> Rb, or nullptr
+    static const char* mnemonic(Interpreter::Node::Kind kind) {
+        using Node = Interpreter::Node;
+        switch (kind) {
+            case Node::ADD: return "ADD";
+            case Node::SUB: return "SUB";
+            case Node::MUL: return "MUL";
+            case Node::DIV: return "DIV";
+            case Node::EQ: return "EQ";
+            case Node::LT: return "LT";
+            case Node::GT: return "GT";
+            default: return nullptr;
+        }
+    }
+
+    bool has_call(const Interpreter::Code& code, int index) const {
+        const Interpreter::Node& node = code.nodes[index];
+        switch (node.kind) {
+            case Interpreter::Node::CALL: return true;
+            case Interpreter::Node::BUILTIN:
+                return node.value == Interpreter::MAP_BUILTIN ||
+                       (node.value == Interpreter::FILL_BUILTIN && has_call(code, code.arguments[node.left + 1]));
+            case Interpreter::Node::NUMBER:
+            case Interpreter::Node::VARIABLE:
+            case Interpreter::Node::LOCAL: return false;
+            case Interpreter::Node::ARRAY: return has_call(code, node.left);
+            default: return has_call(code, node.left) || has_call(code, node.right);
+        }
+    }
+
+    // Store the value of node index in register target. "x = x + e" with x
+    // in target updates it in place, unless a call in e could change x first.
+    void assign(const Interpreter::Code& code, int index, int target) {
+        const Interpreter::Node& node = code.nodes[index];
+        const char* op = mnemonic(node.kind);
+        if (op && (node.kind == Interpreter::Node::ADD || node.kind == Interpreter::Node::SUB ||
+                   node.kind == Interpreter::Node::MUL || node.kind == Interpreter::Node::DIV) &&
+            resident(code.nodes[node.left]) == target && !has_call(code, node.right)) {
+            int right = operand(code, node.right);
+            emit(op + (" " + reg(target) + " ") + reg(right));
+            return;
+        }
+        int r = expression(code, index);
+        emit("MOV " + reg(target) + " 0");
+        emit("ADD " + reg(target) + " " + reg(r));
+    }
+
+    // Registers expression() needs at its peak to evaluate node index,
+    // roughly for calls and builtins
+    int need(const Interpreter::Code& code, int index) const {
+        const Interpreter::Node& node = code.nodes[index];
+        switch (node.kind) {
+            case Interpreter::Node::NUMBER:
+            case Interpreter::Node::VARIABLE:
+            case Interpreter::Node::LOCAL: return 1;
+            case Interpreter::Node::ARRAY: return std::max(need(code, node.left), 3);
+            case Interpreter::Node::CALL: {
+                int peak = 1;
+                for (int i = 0; i < node.right; i++) peak = std::max(peak, i + need(code, code.arguments[node.left + i]));
+                return peak;
+            }
+            case Interpreter::Node::BUILTIN: return 4;
+            default: {
+                int right = resident(code.nodes[node.right]) >= 0 ? 0 : need(code, node.right);
+                return std::max(need(code, node.left), 1 + right);
+            }
+        }
+    }
+
+    // Whether evaluating node index can neither fail nor have effects, so
+    // nobody can tell when it happens
+    bool inert(const Interpreter::Code& code, int index) const {
+        const Interpreter::Node& node = code.nodes[index];
+        switch (node.kind) {
+            case Interpreter::Node::NUMBER:
+            case Interpreter::Node::LOCAL: return true;
+            case Interpreter::Node::VARIABLE: return assigned.count(node.value) > 0;
+            case Interpreter::Node::ARRAY:
+            case Interpreter::Node::CALL:
+            case Interpreter::Node::BUILTIN:
+            case Interpreter::Node::DIV: return false;
+            default: return inert(code, node.left) && inert(code, node.right);
+        }
+    }
+
+    // Evaluate the right operand of binary node first, which keeps deep
+    // right-nested expressions like 1 + (2 + (3 + ...)) within two
+    // registers. Only used when the left operand is inert and the right one
+    // makes no call that could change what the left one reads.
+    int reversed(const Interpreter::Code& code, const Interpreter::Node& node) {
+        using Node = Interpreter::Node;
+        int right = expression(code, node.right);
+        int left = expression(code, node.left);
+        switch (node.kind) {
+            case Node::ADD:
+            case Node::MUL:
+            case Node::EQ:
+                emit(mnemonic(node.kind) + (" " + reg(right) + " ") + reg(left));
+                break;
+            case Node::LT:
+            case Node::GT:
+                emit((node.kind == Node::LT ? "GT " : "LT ") + reg(right) + " " + reg(left));
+                break;
+            case Node::SUB:
+            case Node::DIV:
+                emit(mnemonic(node.kind) + (" " + reg(left) + " ") + reg(right));
+                emit("MOV " + reg(right) + " 0");
+                emit("ADD " + reg(right) + " " + reg(left));
+                break;
+            case Node::NE:
+            case Node::LE:
+            case Node::GE: {
+                // Negations of EQ, LT and GT with the operands swapped
+                const char* test = node.kind == Node::NE ? "EQ " : node.kind == Node::LE ? "LT " : "GT ";
+                emit(test + reg(right) + " " + reg(left));
+                emit("MOV " + reg(left) + " 0");
+                emit("EQ " + reg(right) + " " + reg(left));
+                break;
+            }
+            default:
+                break;
+        }
+        frame.top = right + 1;
+        return right;
+    }
+
+    // Evaluate node index into a fresh temporary and return it
+    int expression(const Interpreter::Code& code, int index) {
+        using Node = Interpreter::Node;
+        const Node& node = code.nodes[index];
+        switch (node.kind) {
+            case Node::NUMBER: {
+                int r = allocate();
+                emit("MOV " + reg(r) + " " + std::to_string(node.value));
+                return r;
+            }
+            case Node::LOCAL:
+                return copy(1 + node.value);
+            case Node::VARIABLE: {
+                if (!assigned.count(node.value)) {
+                    if (function_index.count(node.value)) error("Expected '(' for function call");
+                    error("Undefined variable or function: " + name(node.value));
+                }
+                int cached = resident(node);
+                if (cached >= 0) return copy(cached);
+                int r = allocate();
+                emit("LOAD " + reg(r) + " " + std::to_string(variable_cells.at(node.value)));
+                return r;
+            }
+            case Node::ARRAY: {
+                int r = expression(code, node.left);
+                check_bounds(node.value, r);
+                int base = allocate();
+                emit("LOAD " + reg(base) + " " + std::to_string(array_cells.at(node.value)));
+                emit("ADD " + reg(base) + " " + reg(r));
+                emit("LOAD " + reg(r) + " [" + reg(base) + "+0]");
+                frame.top = r + 1;
+                return r;
+            }
+            case Node::CALL:
+                return call(code, node);
+            case Node::BUILTIN:
+                return builtin(code, node);
+            default:
+                break;
+        }
+
+        if (inert(code, node.left) && !has_call(code, node.right) && need(code, node.right) > need(code, node.left)) {
+            return reversed(code, node);
+        }
+        int left = expression(code, node.left);
+        int right = operand(code, node.right);
+        switch (node.kind) {
+            case Node::ADD:
+            case Node::SUB:
+            case Node::MUL:
+            case Node::DIV:
+            case Node::EQ:
+            case Node::LT:
+            case Node::GT:
+                emit(mnemonic(node.kind) + (" " + reg(left) + " ") + reg(right));
+                break;
+            case Node::NE:
+            case Node::LE:
+            case Node::GE: {
+                // Negations of EQ, GT and LT
+                const char* test = node.kind == Node::NE ? "EQ " : node.kind == Node::LE ? "GT " : "LT ";
+                emit(test + reg(left) + " " + reg(right));
+                int zero = allocate();
+                emit("MOV " + reg(zero) + " 0");
+                emit("EQ " + reg(left) + " " + reg(zero));
+                break;
+            }
+            default:
+                break;
+        }
+        frame.top = left + 1;
+        return left;
+    }
+
+    int call(const Interpreter::Code& code, const Interpreter::Node& node) {
+        auto found = function_index.find(node.value);
+        if (found == function_index.end()) error("Undefined function: " + name(node.value));
+        const Interpreter::Function& func = parsed.functions[found->second].second;
+        if (static_cast<size_t>(node.right) < func.parameters.size()) error("Expected ',' between function arguments");
+        if (static_cast<size_t>(node.right) > func.parameters.size()) error("Expected ')' after function arguments");
+
+        int first = frame.top;
+        for (int i = 0; i < node.right; i++) {
+            int r = expression(code, code.arguments[node.left + i]);
+            if (r != first + i) error("Internal error: arguments out of order");
+        }
+        emit_call(node.value, first, node.right);
+
+        frame.top = first;
+        int r = allocate();
+        emit("MOV " + reg(r) + " 0");
+        emit("ADD " + reg(r) + " R0");
+        return r;
+    }
+
+    // Call function id on the count arguments in R<first> upwards, leaving
+    // the result in R0
+    void emit_call(int id, int first, int count) {
+        // Save the live registers R1..R<first - 1> around the call. Arguments
+        // that already sit in R1..Rn need no stub.
+        std::string window = first > 1 ? " R1 " + reg(first - 1) : "";
+        std::string target = "fn_" + name(id);
+        if (first > 1 && count > 0) {
+            Stub stub = {new_label(), target, first, count};
+            stubs.push_back(stub);
+            target = stub.label;
+        }
+        spill("STORE");
+        emit("CALL " + target + window);
+        spill("LOAD");
+    }
+
+    // Copy src into the existing register dst
+    void move(int dst, int src) {
+        emit("MOV " + reg(dst) + " 0");
+        emit("ADD " + reg(dst) + " " + reg(src));
+    }
+
+    // Load the base cell and size of array into registers base and size
+    void load_array(int array, int base, int size) {
+        emit("LOAD " + reg(base) + " " + std::to_string(array_cells.at(array)));
+        emit("LOAD " + reg(size) + " " + std::to_string(array_cells.at(array) + 1));
+    }
+
+    // Jump to the size error stub of array unless registers size and other
+    // are equal. Clobbers other.
+    void check_same_size(int size, int other, int array) {
+        std::string stub = "_sizes_" + name(array);
+        size_errors.emplace(stub, "Array sizes differ: " + name(array));
+        int zero = allocate();
+        emit("MOV " + reg(zero) + " 0");
+        emit("EQ " + reg(other) + " " + reg(size));
+        emit("JEQ " + reg(other) + " " + reg(zero) + " " + stub);
+        frame.top = zero;
+    }
+
+    // Interpreter::Builtin calls. fill and copy are single MEMSET and
+    // MEMCPY instructions; sum, dot and map walk pointers over the cells.
+    int builtin(const Interpreter::Code& code, const Interpreter::Node& node) {
+        const int* args = &code.arguments[node.left];
+        switch (node.value) {
+            case Interpreter::FILL_BUILTIN: {
+                int value = expression(code, args[1]);
+                int base = allocate();
+                int size = allocate();
+                load_array(args[0], base, size);
+                emit("MEMSET " + reg(base) + " " + reg(value) + " " + reg(size));
+                move(value, size);
+                frame.top = value + 1;
+                return value;
+            }
+            case Interpreter::COPY_BUILTIN: {
+                int dst = allocate();
+                int size = allocate();
+                load_array(args[0], dst, size);
+                int src = allocate();
+                int other = allocate();
+                load_array(args[1], src, other);
+                check_same_size(size, other, args[1]);
+                emit("MEMCPY " + reg(dst) + " " + reg(src) + " " + reg(size));
+                move(dst, size);
+                frame.top = dst + 1;
+                return dst;
+            }
+            case Interpreter::SUM_BUILTIN:
+            case Interpreter::DOT_BUILTIN: {
+                bool dot = node.value == Interpreter::DOT_BUILTIN;
+                int total = allocate();
+                emit("MOV " + reg(total) + " 0");
+                int p = allocate();
+                int end = allocate();
+                load_array(args[0], p, end);
+                int q = -1;
+                if (dot) {
+                    q = allocate();
+                    int other = allocate();
+                    load_array(args[1], q, other);
+                    check_same_size(end, other, args[1]);
+                    frame.top = other;
+                }
+                emit("ADD " + reg(end) + " " + reg(p));
+                int one = allocate();
+                int x = allocate();
+                int y = dot ? allocate() : -1;
+                emit("MOV " + reg(one) + " 1");
+                std::string top = new_label();
+                std::string done = new_label();
+                label(top);
+                emit("JEQ " + reg(p) + " " + reg(end) + " " + done);
+                emit("LOAD " + reg(x) + " [" + reg(p) + "+0]");
+                if (dot) {
+                    emit("LOAD " + reg(y) + " [" + reg(q) + "+0]");
+                    emit("MUL " + reg(x) + " " + reg(y));
+                    emit("ADD " + reg(q) + " " + reg(one));
+                }
+                emit("ADD " + reg(total) + " " + reg(x));
+                emit("ADD " + reg(p) + " " + reg(one));
+                emit("JMP " + top);
+                label(done);
+                frame.top = total + 1;
+                return total;
+            }
+            case Interpreter::MAP_BUILTIN: {
+                auto found = function_index.find(args[2]);
+                if (found == function_index.end()) error("Undefined function: " + name(args[2]));
+                if (parsed.functions[found->second].second.parameters.size() != 1) {
+                    error("map needs a function of one parameter: " + name(args[2]));
+                }
+                int dst = allocate();
+                int size = allocate();
+                load_array(args[0], dst, size);
+                int src = allocate();
+                int end = allocate();
+                load_array(args[1], src, end);
+                check_same_size(size, end, args[1]);
+                move(end, src);
+                emit("ADD " + reg(end) + " " + reg(size));
+                int one = allocate();
+                emit("MOV " + reg(one) + " 1");
+                std::string top = new_label();
+                std::string done = new_label();
+                label(top);
+                emit("JEQ " + reg(src) + " " + reg(end) + " " + done);
+                int argument = allocate();
+                emit("LOAD " + reg(argument) + " [" + reg(src) + "+0]");
+                emit_call(args[2], argument, 1);
+                emit("STORE R0 [" + reg(dst) + "+0]");
+                emit("ADD " + reg(dst) + " " + reg(one));
+                emit("ADD " + reg(src) + " " + reg(one));
+                emit("JMP " + top);
+                label(done);
+                move(dst, size);
+                frame.top = dst + 1;
+                return dst;
+            }
+        }
+        error("Internal error: unknown builtin");
+    }
+
+    // Jump to target when the value of node index is zero
+    void branch_if_false(const Interpreter::Code& code, int index, const std::string& target) {
+        int zero = allocate();
+        emit("MOV " + reg(zero) + " 0");
+        int r = expression(code, index);
+        emit("JEQ " + reg(r) + " " + reg(zero) + " " + target);
+        frame.top = zero;
+    }
+
+    void block(const Interpreter::Code& code, Interpreter::Block block) {
+        for (int i = 0; i < block.count; i++) {
+            statement(code, code.statements[code.sequence[block.first + i]]);
+        }
+    }
+
+    void statement(const Interpreter::Code& code, const Interpreter::Statement& statement) {
+        using Statement = Interpreter::Statement;
+        int base = frame.top;
+        switch (statement.kind) {
+            case Statement::EVALUATE: {
+                int r = expression(code, statement.value);
+                if (frame.result >= 0) {
+                    emit("MOV " + reg(frame.result) + " 0");
+                    emit("ADD " + reg(frame.result) + " " + reg(r));
+                }
+                break;
+            }
+            case Statement::ASSIGN: {
+                auto cached = frame.globals.find(statement.target);
+                if (cached != frame.globals.end()) {
+                    assign(code, statement.value, cached->second);
+                } else {
+                    int r = expression(code, statement.value);
+                    emit("STORE " + reg(r) + " " + std::to_string(variable_cells.at(statement.target)));
+                }
+                break;
+            }
+            case Statement::ASSIGN_LOCAL:
+                assign(code, statement.value, 1 + statement.target);
+                break;
+            case Statement::STORE: {
+                int index = expression(code, statement.index);
+                int value = expression(code, statement.value);
+                check_bounds(statement.target, index);
+                int address = allocate();
+                emit("LOAD " + reg(address) + " " + std::to_string(array_cells.at(statement.target)));
+                emit("ADD " + reg(address) + " " + reg(index));
+                emit("STORE " + reg(value) + " [" + reg(address) + "+0]");
+                break;
+            }
+            case Statement::DECLARE_ARRAY: {
+                // Bump-allocate size zeroed cells and point the descriptor at them
+                int size = expression(code, statement.value);
+                int zero = allocate();
+                int cells = allocate();
+                emit("MOV " + reg(zero) + " 0");
+                emit("MOV " + reg(cells) + " 0");
+                emit("ADD " + reg(cells) + " " + reg(size));
+                emit("LT " + reg(cells) + " " + reg(zero));
+                emit("MOV " + reg(zero) + " 1");
+                emit("JEQ " + reg(cells) + " " + reg(zero) + " _negative_size");
+                int array = array_cells.at(statement.target);
+                emit("LOAD " + reg(cells) + " " + std::to_string(heap_top_cell));
+                emit("STORE " + reg(cells) + " " + std::to_string(array));
+                emit("STORE " + reg(size) + " " + std::to_string(array + 1));
+                emit("MOV " + reg(zero) + " 0");
+                emit("MEMSET " + reg(cells) + " " + reg(zero) + " " + reg(size));
+                emit("ADD " + reg(cells) + " " + reg(size));
+                emit("STORE " + reg(cells) + " " + std::to_string(heap_top_cell));
+                break;
+            }
+            case Statement::IF: {
+                std::string orelse = new_label();
+                std::string end = new_label();
+                branch_if_false(code, statement.value, orelse);
+                block(code, statement.body);
+                emit("JMP " + end);
+                label(orelse);
+                block(code, statement.orelse);
+                label(end);
+                break;
+            }
+            case Statement::WHILE: {
+                std::string top = new_label();
+                std::string end = new_label();
+                label(top);
+                branch_if_false(code, statement.value, end);
+                block(code, statement.body);
+                emit("JMP " + top);
+                label(end);
+                break;
+            }
+            case Statement::RETURN: {
+                int r = expression(code, statement.value);
+                emit("MOV R0 0");
+                emit("ADD R0 " + reg(r));
+                emit("RET");
+                break;
+            }
+        }
+        frame.top = base;
+    }
+
+    void function(int id, const Interpreter::Function& func) {
+        int parameters = static_cast<int>(func.parameters.size());
+        frame = Frame();
+        frame.result = parameters + 1;
+        frame.top = parameters + 2;
+        if (frame.top > registerCount) error("Too many parameters for the VM: " + name(id));
+        label("fn_" + name(id));
+        emit("MOV " + reg(frame.result) + " 0");
+        block(func.code, func.body);
+        emit("MOV R0 0");
+        emit("ADD R0 " + reg(frame.result));
+        emit("RET");
+        emit_stubs();
+    }
+
+    // Apply the Interpreter's purity rule to memo function index: nothing it
+    // calls, directly or not, may change a global or array
+    void check_memo(size_t index) {
+        std::vector<bool> visited(parsed.functions.size());
+        std::vector<size_t> pending = {index};
+        visited[index] = true;
+        while (!pending.empty()) {
+            const Interpreter::Function& func = parsed.functions[pending.back()].second;
+            pending.pop_back();
+            int written = front_end.written_name(func);
+            if (written >= 0) error("Memo function calls a function that changes " + name(written));
+            for (const Interpreter::Node& node : func.code.nodes) {
+                if (node.kind != Interpreter::Node::CALL) continue;
+                auto callee = function_index.find(node.value);
+                if (callee != function_index.end() && !visited[callee->second]) {
+                    visited[callee->second] = true;
+                    pending.push_back(callee->second);
+                }
+            }
+        }
+    }
+
+    // Entry in parsed.functions that node of code calls, directly or
+    // through map, or -1
+    int callee(const Interpreter::Code& code, const Interpreter::Node& node) const {
+        int id = -1;
+        if (node.kind == Interpreter::Node::CALL) {
+            id = node.value;
+        } else if (node.kind == Interpreter::Node::BUILTIN && node.value == Interpreter::MAP_BUILTIN) {
+            id = code.arguments[node.left + 2];
+        }
+        auto found = function_index.find(id);
+        return found == function_index.end() ? -1 : static_cast<int>(found->second);
+    }
+
+    // The Interpreter looks functions up as they are called, so a call in
+    // top-level node index may only reach functions declared before it
+    void check_declared(int index, int first) {
+        std::vector<bool> visited(parsed.functions.size());
+        std::vector<int> pending = {first};
+        visited[first] = true;
+        while (!pending.empty()) {
+            int next = pending.back();
+            pending.pop_back();
+            if (parsed.declared[next] > index) error("Undefined function: " + name(parsed.functions[next].first));
+            const Interpreter::Code& code = parsed.functions[next].second.code;
+            for (const Interpreter::Node& node : code.nodes) {
+                int entry = callee(code, node);
+                if (entry >= 0 && !visited[entry]) {
+                    visited[entry] = true;
+                    pending.push_back(entry);
+                }
+            }
+        }
+    }
+
+    void emit_stubs() {
+        for (const Stub& stub : stubs) {
+            label(stub.label);
+            for (int i = 0; i < stub.count; i++) {
+                emit("MOV " + reg(1 + i) + " 0");
+                emit("ADD " + reg(1 + i) + " " + reg(stub.first + i));
+            }
+            emit("JMP " + stub.function);
+        }
+        stubs.clear();
+    }
+
+public:
+    static constexpr size_t defaultArrayCells = 1 << 20;  // Heap cells for arrays when no size is given
+    static constexpr size_t defaultCallDepth = 5000;  // Same limit as the tree-walking Interpreter
+
+    // Parse text and lower it to a VM program. optimize runs the VM's
+    // peephole optimizer over the result.
+    CompiledScript compile(const std::string& text, bool optimize = true) {
+        front_end = Interpreter();
+        parsed = {};
+        out.clear();
+        variable_cells.clear();
+        array_cells.clear();
+        function_index.clear();
+        assigned.clear();
+        size_errors.clear();
+        stubs.clear();
+        labels = 0;
+        front_end.parse(text, parsed);
+
+        for (size_t i = 0; i < parsed.functions.size(); i++) {
+            int id = parsed.functions[i].first;
+            if (!function_index.emplace(id, i).second) {
+                error("Function redeclared: " + name(id) + " (not supported when compiling to bytecode)");
+            }
+            collect(parsed.functions[i].second.code);
+        }
+        for (size_t i = 0; i < parsed.functions.size(); i++) {
+            if (parsed.functions[i].second.memo) check_memo(i);
+        }
+        collect(parsed.code);
+        // Top-level nodes run in order, so a function that was fully
+        // declared at one call stays so at every later one
+        std::vector<bool> declared(parsed.functions.size());
+        for (size_t i = 0; i < parsed.code.nodes.size(); i++) {
+            int entry = callee(parsed.code, parsed.code.nodes[i]);
+            if (entry >= 0 && !declared[entry]) {
+                check_declared(static_cast<int>(i), entry);
+                declared[entry] = true;
+            }
+        }
+
+        CompiledScript script;
+        int cell = heap_top_cell + 1;
+        for (auto& variable : variable_cells) {
+            variable.second = cell++;
+            script.globals.emplace(name(variable.first), variable.second);
+        }
+        for (auto& array : array_cells) {
+            array.second = cell;
+            cell += 2;
+        }
+        script.static_cells = static_cast<size_t>(cell);
+
+        // Top-level code first, then everything it jumps to. Up to half the
+        // registers cache the globals it uses, in order of first use.
+        frame = {};
+        for (const Interpreter::Node& node : parsed.code.nodes) {
+            if (node.kind == Interpreter::Node::VARIABLE && assigned.count(node.value) &&
+                frame.top < registerCount / 2 && frame.globals.emplace(node.value, frame.top).second) {
+                frame.top++;
+            }
+        }
+        for (const Interpreter::Statement& statement : parsed.code.statements) {
+            if (statement.kind == Interpreter::Statement::ASSIGN && frame.top < registerCount / 2 &&
+                frame.globals.emplace(statement.target, frame.top).second) {
+                frame.top++;
+            }
+        }
+        int heap_top = allocate();
+        emit("MOV " + reg(heap_top) + " " + std::to_string(cell));
+        emit("STORE " + reg(heap_top) + " " + std::to_string(heap_top_cell));
+        frame.top = heap_top;
+        block(parsed.code, parsed.main);
+        spill("STORE");
+        emit("JMP _end");
+        emit_stubs();
+        for (const auto& declared : parsed.functions) {
+            function(declared.first, declared.second);
+        }
+        // Each error stub faults on its own instruction, which names the error
+        label("_bounds");
+        emit("LOAD R0 -1");
+        script.errors.emplace("_bounds", "Array index out of bounds");
+        label("_negative_size");
+        emit("LOAD R0 -1");
+        script.errors.emplace("_negative_size", "Array size must not be negative");
+        for (const auto& stub : size_errors) {
+            label(stub.first);
+            emit("LOAD R0 -1");
+            script.errors.insert(stub);
+        }
+        label("_end");
+
+        script.program = std::make_shared<Program>();
+        script.program->load(out);
+        if (optimize) script.program->optimize();
+        script.assembly = std::move(out);
+        return script;
+    }
+};
+
+#endif  // BYTECODE_COMPILER_H
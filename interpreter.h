@@ -0,0 +1,1132 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+
+class Interpreter {
+    // One lexical token. Identifiers carry the index of their interned name,
+    // numbers their parsed value and symbols the character itself, or one of
+    // the two-character operator codes below.
+    struct Token {
+        enum Kind { NUMBER, IDENTIFIER, SYMBOL, END };
+        Kind kind;
+        int value;
+    };
+
+    // Symbol values of "==", "!=", "<=" and ">=", outside the character range
+    enum Operator { EQUAL = 256, NOT_EQUAL, LESS_EQUAL, GREATER_EQUAL };
+
+    // Expression tree node. Children are indices into the same Code.
+    struct Node {
+        enum Kind { NUMBER, VARIABLE, LOCAL, ARRAY, CALL, BUILTIN, ADD, SUB, MUL, DIV, EQ, NE, LT, LE, GT, GE };
+        Kind kind;
+        int value;  // NUMBER: the literal; LOCAL: frame slot; VARIABLE, ARRAY, CALL, BUILTIN: interned name
+        int left;   // Operands; ARRAY: index node; CALL, BUILTIN: first entry in arguments
+        int right;  // CALL, BUILTIN: argument count
+
+        bool operator==(const Node& other) const {
+            return kind == other.kind && value == other.value && left == other.left && right == other.right;
+        }
+    };
+
+    // A run of statements: entries [first, first + count) of Code::sequence
+    struct Block {
+        int first = 0;
+        int count = 0;
+
+        bool operator==(const Block& other) const {
+            return first == other.first && count == other.count;
+        }
+    };
+
+    struct Statement {
+        enum Kind { EVALUATE, ASSIGN, ASSIGN_LOCAL, STORE, DECLARE_ARRAY, IF, WHILE, RETURN };
+        Kind kind;
+        int target;  // ASSIGN, STORE, DECLARE_ARRAY: interned name; ASSIGN_LOCAL: frame slot
+        int value;   // Value, condition or array size node
+        int index;   // STORE: index node
+        Block body;  // IF, WHILE
+        Block orelse;  // IF
+
+        bool operator==(const Statement& other) const {
+            return kind == other.kind && target == other.target && value == other.value && index == other.index &&
+                   body == other.body && orelse == other.orelse;
+        }
+    };
+
+    // Parsed code: flat node and statement storage, linked by index
+    struct Code {
+        std::vector<Node> nodes;
+        std::vector<int> arguments;  // Argument nodes of every CALL, in order. BUILTIN
+                                     // arguments naming an array or function are interned names.
+        std::vector<Statement> statements;
+        std::vector<int> sequence;  // Statements of every Block, in order
+
+        int add(Node node) {
+            nodes.push_back(node);
+            return static_cast<int>(nodes.size()) - 1;
+        }
+
+        int add(Statement statement) {
+            statements.push_back(statement);
+            return static_cast<int>(statements.size()) - 1;
+        }
+
+        // Store a finished list of statements as a Block
+        Block add_block(const int* first, size_t count) {
+            Block block = {static_cast<int>(sequence.size()), static_cast<int>(count)};
+            sequence.insert(sequence.end(), first, first + count);
+            return block;
+        }
+
+        void clear() {
+            nodes.clear();
+            arguments.clear();
+            statements.clear();
+            sequence.clear();
+        }
+
+        bool operator==(const Code& other) const {
+            return nodes == other.nodes && arguments == other.arguments && statements == other.statements &&
+                   sequence == other.sequence;
+        }
+    };
+
+    // Most results a memo function keeps before evicting the least recently used
+    static constexpr size_t memo_capacity = 1 << 12;
+
+    // Results of a memo function by argument tuple: entries in least
+    // recently used order, found through a linear-probing hash table twice
+    // their size. Storage grows once and is reused after clear().
+    struct Memo {
+        int arity = 0;
+        std::vector<int> keys;  // arity arguments per entry
+        std::vector<int> values;
+        std::vector<size_t> hashes;
+        std::vector<int> newer, older;  // Recency list links, -1 at the ends
+        int newest = -1;
+        int oldest = -1;
+        std::vector<int> buckets;  // Entry index or -1
+        // What the results depend on: every global and array the function or
+        // its callees read, with the Symbol::version it had
+        bool collected = false;
+        unsigned definitions = 0;  // Interpreter::definitions when collected
+        std::vector<std::pair<int, unsigned>> reads;
+
+        size_t hash(const int* args) const {
+            uint64_t h = 0;
+            for (int i = 0; i < arity; i++) {
+                h = (h ^ static_cast<uint32_t>(args[i])) * 0x9E3779B97F4A7C15ull;
+                h ^= h >> 29;
+            }
+            return static_cast<size_t>(h);
+        }
+
+        size_t mask() const {
+            return buckets.size() - 1;
+        }
+
+        // Bucket holding the entry for args, or the empty one where it would go
+        size_t probe(const int* args, size_t h) const {
+            size_t i = h & mask();
+            while (buckets[i] >= 0) {
+                int e = buckets[i];
+                if (hashes[e] == h && std::equal(args, args + arity, keys.data() + static_cast<size_t>(e) * arity)) break;
+                i = (i + 1) & mask();
+            }
+            return i;
+        }
+
+        void unlink(int e) {
+            (older[e] >= 0 ? newer[older[e]] : oldest) = newer[e];
+            (newer[e] >= 0 ? older[newer[e]] : newest) = older[e];
+        }
+
+        void push_newest(int e) {
+            newer[e] = -1;
+            older[e] = newest;
+            (newest >= 0 ? newer[newest] : oldest) = e;
+            newest = e;
+        }
+
+        bool lookup(const int* args, int& value) {
+            if (values.empty()) return false;
+            int e = buckets[probe(args, hash(args))];
+            if (e < 0) return false;
+            if (e != newest) {
+                unlink(e);
+                push_newest(e);
+            }
+            value = values[e];
+            return true;
+        }
+
+        // Empty bucket i, shifting back later entries of its probe run so
+        // no lookup stops short of them
+        void erase_bucket(size_t i) {
+            for (size_t j = (i + 1) & mask(); buckets[j] >= 0; j = (j + 1) & mask()) {
+                size_t home = hashes[buckets[j]] & mask();
+                if (((j - home) & mask()) >= ((j - i) & mask())) {
+                    buckets[i] = buckets[j];
+                    i = j;
+                }
+            }
+            buckets[i] = -1;
+        }
+
+        void insert(const int* args, int value) {
+            if (buckets.empty()) buckets.assign(2 * memo_capacity, -1);
+            size_t h = hash(args);
+            size_t i = probe(args, h);
+            if (buckets[i] >= 0) {
+                values[buckets[i]] = value;
+                return;
+            }
+            int e;
+            if (values.size() < memo_capacity) {
+                e = static_cast<int>(values.size());
+                keys.insert(keys.end(), args, args + arity);
+                values.push_back(value);
+                hashes.push_back(h);
+                newer.push_back(-1);
+                older.push_back(-1);
+            } else {  // Evict the least recently used
+                e = oldest;
+                unlink(e);
+                erase_bucket(probe(keys.data() + static_cast<size_t>(e) * arity, hashes[e]));
+                std::copy(args, args + arity, keys.data() + static_cast<size_t>(e) * arity);
+                values[e] = value;
+                hashes[e] = h;
+                i = probe(args, h);
+            }
+            buckets[i] = e;
+            push_newest(e);
+        }
+
+        void clear() {
+            keys.clear();
+            values.clear();
+            hashes.clear();
+            newer.clear();
+            older.clear();
+            newest = oldest = -1;
+            std::fill(buckets.begin(), buckets.end(), -1);
+        }
+    };
+
+    struct Function {
+        std::vector<int> parameters;  // Interned names, by frame slot
+        Code code;   // Compiled once at declaration
+        Block body;
+        bool memo = false;  // Declared "memo function"
+
+        bool operator==(const Function& other) const {
+            return parameters == other.parameters && code == other.code && body == other.body && memo == other.memo;
+        }
+    };
+
+    // Everything a global name is bound to, indexed by its interned id
+    struct Symbol {
+        bool assigned = false;
+        int value = 0;
+        int function = -1;  // Index in functions, or -1
+        int array = -1;     // Index in arrays, or -1
+        unsigned version = 0;  // Bumped whenever the variable or array changes
+    };
+
+    // Keywords are interned first, so their ids are fixed
+    enum Keyword { FUNCTION_KEYWORD, ARRAY_KEYWORD, IF_KEYWORD, ELSE_KEYWORD, WHILE_KEYWORD, FOR_KEYWORD,
+                   RETURN_KEYWORD, MEMO_KEYWORD };
+
+    // Whole-array operations, interned after the keywords. They are only
+    // reserved as function names, so "sum = 0" is still a variable.
+    //   fill(a, value)   every element of a = value; returns the size
+    //   copy(dst, src)   dst = src, same size; returns the size
+    //   sum(a)           sum of the elements
+    //   dot(a, b)        sum of a[i] * b[i], same size
+    //   map(dst, src, f) dst[i] = f(src[i]), same size; returns the size
+    enum Builtin { FILL_BUILTIN = MEMO_KEYWORD + 1, COPY_BUILTIN, SUM_BUILTIN, DOT_BUILTIN, MAP_BUILTIN };
+
+    static bool is_builtin(int name) {
+        return name >= FILL_BUILTIN && name <= MAP_BUILTIN;
+    }
+
+    // Deep enough for real recursion, shallow enough not to overflow the C++ stack
+    static constexpr int max_call_depth = 5000;
+
+    // Parsing and evaluation reuse the storage below from one statement and
+    // one interpret() to the next, so once it has grown to fit a script,
+    // running it allocates nothing but the arrays it declares.
+    std::vector<Token> tokens;  // Tokens of the text given to interpret()
+    size_t pos = 0;  // Index of the current token
+    std::vector<std::string> names;  // Interned identifiers, indexed by Token::value
+    std::unordered_map<std::string, int> name_index;  // Identifier -> index in names
+    std::vector<Symbol> symbols;  // Global bindings, parallel to names
+    // Declarations are immutable once compiled, so copies of an Interpreter
+    // share them; redefining a name swaps in a new one
+    std::vector<std::shared_ptr<const Function>> functions;
+    std::vector<Memo> memos;  // Results of memo functions, parallel to functions
+    std::vector<std::vector<int>> arrays;
+    Code scratch;  // Reused for top-level statements
+    Function declaring;  // Reused for top-level function declarations
+    std::vector<int> parts;  // Statements and call arguments of the lists being parsed, innermost last
+    std::string key;  // Identifier being looked up by tokenize()
+    bool in_function = false;  // Whether a function body is being compiled
+    std::vector<int> scope;  // Parameters of the function being compiled, by slot
+    std::vector<int> stack;  // Locals of every active call, one frame after another
+    size_t frame = 0;  // Start of the innermost frame in stack
+    int depth = 0;  // Active calls
+    unsigned definitions = 0;  // Function declarations so far, to invalidate memo dependencies
+    std::vector<int> memo_args;  // Arguments of the active memo calls, innermost last
+    std::string pending;  // Input given to feed() that has not run yet
+    size_t scanned = 0;  // Prefix of pending already searched for statement ends
+    int nesting = 0;  // Brackets open at the end of that prefix
+
+    [[noreturn]] void error(const std::string& msg) {
+        throw std::runtime_error("Error: " + msg);
+    }
+
+    int intern(const std::string& name) {
+        auto it = name_index.find(name);
+        if (it != name_index.end()) return it->second;
+        name_index.emplace(name, static_cast<int>(names.size()));
+        names.push_back(name);
+        symbols.emplace_back();
+        return static_cast<int>(names.size()) - 1;
+    }
+
+    // Split text into tokens once, ending with an END token. Reuses the
+    // storage of the previous call, which matters when feed() runs many
+    // short statements.
+    void tokenize(std::string_view text) {
+        std::vector<Token>& result = tokens;
+        result.clear();
+        result.reserve(text.length() + 1);  // Never more tokens than characters
+        size_t i = 0;
+        while (i < text.length()) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (isspace(c)) {
+                i++;
+            } else if (isdigit(c)) {
+                long long value = 0;
+                while (i < text.length() && isdigit(static_cast<unsigned char>(text[i]))) {
+                    value = value * 10 + (text[i] - '0');
+                    if (value > INT_MAX) error("Integer literal out of range");
+                    i++;
+                }
+                result.push_back({Token::NUMBER, static_cast<int>(value)});
+            } else if (isalpha(c)) {
+                size_t start = i;
+                while (i < text.length() && (isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_')) {
+                    i++;
+                }
+                result.push_back({Token::IDENTIFIER, intern(key.assign(text.data() + start, i - start))});
+            } else if (i + 1 < text.length() && text[i + 1] == '=' && (c == '=' || c == '!' || c == '<' || c == '>')) {
+                int symbol = c == '=' ? EQUAL : c == '!' ? NOT_EQUAL : c == '<' ? LESS_EQUAL : GREATER_EQUAL;
+                result.push_back({Token::SYMBOL, symbol});
+                i += 2;
+            } else {
+                result.push_back({Token::SYMBOL, c});
+                i++;
+            }
+        }
+        result.push_back({Token::END, 0});
+    }
+
+    const Token& current() const {
+        return tokens[pos];
+    }
+
+    void advance() {
+        if (current().kind != Token::END) pos++;
+    }
+
+    // Whether the current token is the symbol c, a character or an Operator
+    bool at(int c) const {
+        return current().kind == Token::SYMBOL && current().value == c;
+    }
+
+    // Whether the current token is the keyword with interned id keyword
+    bool at_keyword(int keyword) const {
+        return current().kind == Token::IDENTIFIER && current().value == keyword;
+    }
+
+    // Messages are C strings so the common, successful path builds none
+    void expect(char c, const char* msg) {
+        if (!at(c)) error(msg);
+        advance();
+    }
+
+    // Consume an identifier and return its interned id
+    int identifier(const char* msg) {
+        if (current().kind != Token::IDENTIFIER) error(msg);
+        int name = current().value;
+        advance();
+        return name;
+    }
+
+    // Frame slot of a parameter of the function being compiled, or -1
+    int local_slot(int name) const {
+        for (size_t slot = 0; slot < scope.size(); slot++) {
+            if (scope[slot] == name) return static_cast<int>(slot);
+        }
+        return -1;
+    }
+
+    // Parse a primary expression into out and return its node
+    int factor(Code& out) {
+        const Token& token = current();
+        if (token.kind == Token::NUMBER) {
+            advance();
+            return out.add({Node::NUMBER, token.value, -1, -1});
+        } else if (token.kind == Token::IDENTIFIER) {
+            int name = token.value;
+            advance();
+            if (at('[')) {  // Array access
+                advance();
+                int index = expr(out);
+                expect(']', "Expected ']' for array access");
+                return out.add({Node::ARRAY, name, index, -1});
+            } else if (at('(')) {  // Function call
+                return call(out, name);
+            }
+            int slot = local_slot(name);
+            if (slot >= 0) return out.add({Node::LOCAL, slot, -1, -1});  // Parameter access
+            return out.add({Node::VARIABLE, name, -1, -1});  // Global variable access
+        } else if (at('(')) {
+            advance();
+            int result = expr(out);
+            expect(')', "Expected ')'");
+            return result;
+        }
+        error("Invalid factor");
+    }
+
+    int term(Code& out) {
+        int result = factor(out);
+        while (at('*') || at('/')) {
+            Node::Kind kind = at('*') ? Node::MUL : Node::DIV;
+            advance();
+            int right = factor(out);
+            result = out.add({kind, 0, result, right});
+        }
+        return result;
+    }
+
+    int sum(Code& out) {
+        int result = term(out);
+        while (at('+') || at('-')) {
+            Node::Kind kind = at('+') ? Node::ADD : Node::SUB;
+            advance();
+            int right = term(out);
+            result = out.add({kind, 0, result, right});
+        }
+        return result;
+    }
+
+    // Comparisons bind loosest and yield 1 or 0
+    int expr(Code& out) {
+        int result = sum(out);
+        while (true) {
+            Node::Kind kind;
+            if (at(EQUAL)) kind = Node::EQ;
+            else if (at(NOT_EQUAL)) kind = Node::NE;
+            else if (at('<')) kind = Node::LT;
+            else if (at(LESS_EQUAL)) kind = Node::LE;
+            else if (at('>')) kind = Node::GT;
+            else if (at(GREATER_EQUAL)) kind = Node::GE;
+            else return result;
+            advance();
+            int right = sum(out);
+            result = out.add({kind, 0, result, right});
+        }
+    }
+
+    // "name(arg, ...)" with the name already consumed
+    int call(Code& out, int name) {
+        if (is_builtin(name)) return builtin(out, name);
+        expect('(', "Expected '(' for function call");
+        size_t start = parts.size();
+        if (!at(')')) {
+            parts.push_back(expr(out));
+            while (at(',')) {
+                advance();
+                parts.push_back(expr(out));
+            }
+        }
+        expect(')', "Expected ')' after function arguments");
+        int first = static_cast<int>(out.arguments.size());
+        int count = static_cast<int>(parts.size() - start);
+        out.arguments.insert(out.arguments.end(), parts.begin() + start, parts.end());
+        parts.resize(start);
+        return out.add({Node::CALL, name, first, count});
+    }
+
+    // A Builtin call with the name already consumed. Arrays and map's
+    // function are bare names, resolved when the call runs.
+    int builtin(Code& out, int name) {
+        expect('(', "Expected '(' for function call");
+        int args[3];
+        int count = 0;
+        args[count++] = identifier("Expected array name");
+        if (name != SUM_BUILTIN) {
+            expect(',', "Expected ',' between function arguments");
+            args[count++] = name == FILL_BUILTIN ? expr(out) : identifier("Expected array name");
+        }
+        if (name == MAP_BUILTIN) {
+            expect(',', "Expected ',' between function arguments");
+            args[count++] = identifier("Expected function name");
+        }
+        expect(')', "Expected ')' after function arguments");
+        int first = static_cast<int>(out.arguments.size());
+        out.arguments.insert(out.arguments.end(), args, args + count);
+        return out.add({Node::BUILTIN, name, first, count});
+    }
+
+    int evaluate(const Code& code, int index) {
+        const Node& node = code.nodes[index];
+        switch (node.kind) {
+            case Node::NUMBER:
+                return node.value;
+            case Node::VARIABLE: {
+                const Symbol& symbol = symbols[node.value];
+                if (symbol.assigned) return symbol.value;
+                if (symbol.function >= 0) error("Expected '(' for function call");
+                error("Undefined variable or function: " + names[node.value]);
+            }
+            case Node::LOCAL:
+                return stack[frame + node.value];
+            case Node::ARRAY: {
+                int array_index = evaluate(code, node.left);
+                int array = symbols[node.value].array;
+                if (array < 0) error("Undefined array: " + names[node.value]);
+                const std::vector<int>& cells = arrays[array];
+                if (array_index < 0 || static_cast<size_t>(array_index) >= cells.size()) error("Array index out of bounds");
+                return cells[array_index];
+            }
+            case Node::CALL:
+                return call_function(code, node);
+            case Node::BUILTIN:
+                return call_builtin(code, node);
+            default: {
+                int left = evaluate(code, node.left);
+                int right = evaluate(code, node.right);
+                switch (node.kind) {
+                    case Node::ADD: return left + right;
+                    case Node::SUB: return left - right;
+                    case Node::MUL: return left * right;
+                    case Node::DIV:
+                        if (right == 0) error("Division by zero");
+                        if (left == INT_MIN && right == -1) error("Integer overflow in division");
+                        return left / right;
+                    case Node::EQ: return left == right;
+                    case Node::NE: return left != right;
+                    case Node::LT: return left < right;
+                    case Node::LE: return left <= right;
+                    case Node::GT: return left > right;
+                    case Node::GE: return left >= right;
+                    default: break;
+                }
+            }
+        }
+        return 0;  // Should never reach here
+    }
+
+    int call_function(const Code& code, const Node& call) {
+        int index = symbols[call.value].function;
+        if (index < 0) error("Undefined function: " + names[call.value]);
+        const Function& func = *functions[index];
+
+        if (static_cast<size_t>(call.right) < func.parameters.size()) error("Expected ',' between function arguments");
+        if (static_cast<size_t>(call.right) > func.parameters.size()) error("Expected ')' after function arguments");
+        if (depth == max_call_depth) error("Maximum call depth exceeded");
+
+        // Arguments are evaluated in the caller's frame and become the
+        // callee's locals; an error abandons the whole stack in interpret()
+        size_t base = stack.size();
+        for (int i = 0; i < call.right; i++) {
+            int value = evaluate(code, code.arguments[call.left + i]);
+            stack.push_back(value);
+        }
+        if (func.memo) return call_memo(index, base);
+        return invoke(func, base);
+    }
+
+    // Call memo function index on the arguments pushed from stack[base],
+    // reusing the result of an earlier call with the same arguments
+    int call_memo(int index, size_t base) {
+        Memo& memo = memos[index];
+        check_dependencies(index);
+        int value;
+        if (memo.lookup(stack.data() + base, value)) {
+            stack.resize(base);
+            return value;
+        }
+        // The body may assign its parameters, so keep the key aside
+        size_t start = memo_args.size();
+        memo_args.insert(memo_args.end(), stack.begin() + base, stack.end());
+        value = invoke(*functions[index], base);
+        memo.insert(memo_args.data() + start, value);
+        memo_args.resize(start);
+        return value;
+    }
+
+    // Name of a global or array the body of func assigns, or -1
+    int written_name(const Function& func) const {
+        for (const Statement& statement : func.code.statements) {
+            if (statement.kind == Statement::ASSIGN || statement.kind == Statement::STORE ||
+                statement.kind == Statement::DECLARE_ARRAY) {
+                return statement.target;
+            }
+        }
+        for (const Node& node : func.code.nodes) {
+            if (node.kind == Node::BUILTIN && node.value != SUM_BUILTIN && node.value != DOT_BUILTIN) {
+                return func.code.arguments[node.left];
+            }
+        }
+        return -1;
+    }
+
+    // Empty the cache of memo function index if anything its results
+    // depend on changed. Dependencies are collected through the functions
+    // it calls, so they are collected again after any declaration.
+    void check_dependencies(int index) {
+        Memo& memo = memos[index];
+        if (memo.collected && memo.definitions == definitions) {
+            for (const auto& read : memo.reads) {
+                if (symbols[read.first].version != read.second) {
+                    memo.clear();
+                    for (auto& seen : memo.reads) seen.second = symbols[seen.first].version;
+                    break;
+                }
+            }
+            return;
+        }
+
+        memo.clear();
+        memo.arity = static_cast<int>(functions[index]->parameters.size());
+        memo.reads.clear();
+        auto read = [&](int name) {
+            for (const auto& seen : memo.reads) {
+                if (seen.first == name) return;
+            }
+            memo.reads.emplace_back(name, symbols[name].version);
+        };
+        std::vector<bool> visited(functions.size());
+        std::vector<int> pending_functions = {index};
+        visited[index] = true;
+        while (!pending_functions.empty()) {
+            const Function& func = *functions[pending_functions.back()];
+            pending_functions.pop_back();
+            int written = written_name(func);
+            if (written >= 0) error("Memo function calls a function that changes " + names[written]);
+            for (const Node& node : func.code.nodes) {
+                if (node.kind == Node::VARIABLE || node.kind == Node::ARRAY) {
+                    read(node.value);
+                } else if (node.kind == Node::BUILTIN) {
+                    for (int i = 0; i < (node.value == DOT_BUILTIN ? 2 : 1); i++) read(func.code.arguments[node.left + i]);
+                } else if (node.kind == Node::CALL) {
+                    int callee = symbols[node.value].function;
+                    if (callee >= 0 && !visited[callee]) {  // An undefined one fails when called
+                        visited[callee] = true;
+                        pending_functions.push_back(callee);
+                    }
+                }
+            }
+        }
+        memo.collected = true;
+        memo.definitions = definitions;
+    }
+
+    // Run func on the arguments pushed from stack[base] and pop them
+    int invoke(const Function& func, size_t base) {
+        size_t saved_frame = frame;
+        frame = base;
+        depth++;
+        int result = 0;
+        execute(func.code, func.body, result);
+        depth--;
+        frame = saved_frame;
+        stack.resize(base);
+        return result;
+    }
+
+    // Index in arrays of the array named name
+    int array_of(int name) {
+        int array = symbols[name].array;
+        if (array < 0) error("Undefined array: " + names[name]);
+        return array;
+    }
+
+    // Index of the second array of a two-array Builtin, which must match the first in size
+    int same_size(int array, int name) {
+        int other = array_of(name);
+        if (arrays[other].size() != arrays[array].size()) error("Array sizes differ: " + names[name]);
+        return other;
+    }
+
+    // The Builtin loops run over plain pointers. sum and dot do their
+    // arithmetic in unsigned, so only their results wrap modulo 2^32 and
+    // the compiler is free to vectorize them; evaluate()'s +, - and * are
+    // signed int arithmetic, which is not defined to wrap.
+    int call_builtin(const Code& code, const Node& call) {
+        const int* args = &code.arguments[call.left];
+        switch (call.value) {
+            case FILL_BUILTIN: {
+                int value = evaluate(code, args[1]);  // May declare arrays, so resolve after it
+                std::vector<int>& cells = arrays[array_of(args[0])];
+                std::fill(cells.begin(), cells.end(), value);
+                symbols[args[0]].version++;
+                return static_cast<int>(cells.size());
+            }
+            case COPY_BUILTIN: {
+                int dst = array_of(args[0]);
+                int src = same_size(dst, args[1]);
+                std::copy(arrays[src].begin(), arrays[src].end(), arrays[dst].begin());
+                symbols[args[0]].version++;
+                return static_cast<int>(arrays[dst].size());
+            }
+            case SUM_BUILTIN: {
+                const std::vector<int>& cells = arrays[array_of(args[0])];
+                const int* data = cells.data();
+                unsigned total = 0;
+                for (size_t i = 0, n = cells.size(); i < n; i++) total += static_cast<unsigned>(data[i]);
+                return static_cast<int>(total);
+            }
+            case DOT_BUILTIN: {
+                int a = array_of(args[0]);
+                int b = same_size(a, args[1]);
+                const int* x = arrays[a].data();
+                const int* y = arrays[b].data();
+                unsigned total = 0;
+                for (size_t i = 0, n = arrays[a].size(); i < n; i++) {
+                    total += static_cast<unsigned>(x[i]) * static_cast<unsigned>(y[i]);
+                }
+                return static_cast<int>(total);
+            }
+            case MAP_BUILTIN: {
+                int dst = array_of(args[0]);
+                int src = same_size(dst, args[1]);
+                int index = symbols[args[2]].function;
+                if (index < 0) error("Undefined function: " + names[args[2]]);
+                if (functions[index]->parameters.size() != 1) {
+                    error("map needs a function of one parameter: " + names[args[2]]);
+                }
+                if (depth == max_call_depth) error("Maximum call depth exceeded");
+                // f may redeclare either array, so look them up again for
+                // each element
+                size_t n = arrays[src].size();
+                for (size_t i = 0; i < n; i++) {
+                    if (i >= arrays[src].size()) error("Array index out of bounds");
+                    size_t base = stack.size();
+                    stack.push_back(arrays[src][i]);
+                    int value = invoke(*functions[index], base);
+                    if (i >= arrays[dst].size()) error("Array index out of bounds");
+                    arrays[dst][i] = value;
+                    symbols[args[0]].version++;  // f may read dst
+                }
+                return static_cast<int>(n);
+            }
+        }
+        return 0;  // Should never reach here
+    }
+
+    // Run block; result receives the value of the last expression statement
+    // or return. Returns whether a return statement ended the block.
+    bool execute(const Code& code, Block block, int& result) {
+        for (int i = 0; i < block.count; i++) {
+            const Statement& statement = code.statements[code.sequence[block.first + i]];
+            switch (statement.kind) {
+                case Statement::EVALUATE:
+                    result = evaluate(code, statement.value);
+                    break;
+                case Statement::ASSIGN: {
+                    int value = evaluate(code, statement.value);
+                    Symbol& symbol = symbols[statement.target];
+                    symbol.assigned = true;
+                    symbol.value = value;
+                    symbol.version++;
+                    break;
+                }
+                case Statement::ASSIGN_LOCAL:
+                    stack[frame + statement.target] = evaluate(code, statement.value);
+                    break;
+                case Statement::STORE: {
+                    int index = evaluate(code, statement.index);
+                    int value = evaluate(code, statement.value);
+                    int array = symbols[statement.target].array;
+                    if (array < 0) error("Undefined array: " + names[statement.target]);
+                    std::vector<int>& cells = arrays[array];
+                    if (index < 0 || static_cast<size_t>(index) >= cells.size()) error("Array index out of bounds");
+                    cells[index] = value;
+                    symbols[statement.target].version++;
+                    break;
+                }
+                case Statement::DECLARE_ARRAY: {
+                    int size = evaluate(code, statement.value);
+                    if (size < 0) error("Array size must not be negative");
+                    Symbol& symbol = symbols[statement.target];
+                    symbol.version++;
+                    if (symbol.array < 0) {
+                        symbol.array = static_cast<int>(arrays.size());
+                        arrays.emplace_back(size);
+                    } else {
+                        arrays[symbol.array].assign(size, 0);
+                    }
+                    break;
+                }
+                case Statement::IF:
+                    if (execute(code, evaluate(code, statement.value) ? statement.body : statement.orelse, result)) {
+                        return true;
+                    }
+                    break;
+                case Statement::WHILE:
+                    while (evaluate(code, statement.value)) {
+                        if (execute(code, statement.body, result)) return true;
+                    }
+                    break;
+                case Statement::RETURN:
+                    result = evaluate(code, statement.value);
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether the previous token closed a block, which makes ';' optional
+    bool after_block() const {
+        return pos > 0 && tokens[pos - 1].kind == Token::SYMBOL && tokens[pos - 1].value == '}';
+    }
+
+    // Store parts from start on as a Block of out and pop them
+    Block close_block(Code& out, size_t start) {
+        Block block = out.add_block(parts.data() + start, parts.size() - start);
+        parts.resize(start);
+        return block;
+    }
+
+    // "{ statement; ... }" into out, pushing its statements on parts
+    void block_statements(Code& out) {
+        expect('{', "Expected '{' to start block");
+        while (current().kind != Token::END && !at('}')) {
+            statement(out);
+            if (at(';')) {
+                advance();
+            } else if (!at('}') && !after_block()) {
+                error("Expected ';' after statement");
+            }
+        }
+        expect('}', "Expected '}' to end block");
+    }
+
+    Block block(Code& out) {
+        size_t start = parts.size();
+        block_statements(out);
+        return close_block(out, start);
+    }
+
+    // An assignment, array store or expression, as used by for headers
+    void simple_statement(Code& out) {
+        if (current().kind != Token::IDENTIFIER && current().kind != Token::NUMBER && !at('(')) {
+            error("Unknown statement");
+        }
+        const Token& next = tokens[pos + 1];
+        if (current().kind == Token::IDENTIFIER && next.kind == Token::SYMBOL && next.value == '=') {  // Variable assignment
+            int name = identifier("Expected identifier");
+            advance();
+            int value = expr(out);
+            int slot = local_slot(name);
+            if (slot >= 0) {
+                parts.push_back(out.add({Statement::ASSIGN_LOCAL, slot, value, -1, {}, {}}));
+            } else {
+                parts.push_back(out.add({Statement::ASSIGN, name, value, -1, {}, {}}));
+            }
+            return;
+        }
+        int value = expr(out);
+        const Node& node = out.nodes[value];
+        if (node.kind == Node::ARRAY && at('=')) {  // Array assignment
+            advance();
+            int name = node.value;
+            int index = node.left;
+            parts.push_back(out.add({Statement::STORE, name, expr(out), index, {}, {}}));
+        } else if (at('=')) {
+            error("Invalid assignment target");
+        } else {  // Expression, e.g. a function call
+            parts.push_back(out.add({Statement::EVALUATE, -1, value, -1, {}, {}}));
+        }
+    }
+
+    // Parse one statement into out, pushing what to run on parts
+    void statement(Code& out) {
+        if (at_declaration()) {
+            error("Functions can only be declared at top level");
+        } else if (at_keyword(ARRAY_KEYWORD)) {  // Array declaration
+            advance();
+            int array_name = identifier("Expected array name");
+            expect('[', "Expected '[' for array declaration");
+            int size = expr(out);
+            expect(']', "Expected ']' after array size");
+            parts.push_back(out.add({Statement::DECLARE_ARRAY, array_name, size, -1, {}, {}}));
+        } else if (at_keyword(IF_KEYWORD)) {  // if (condition) {...} [else {...} | else if ...]
+            advance();
+            expect('(', "Expected '(' after if");
+            int condition = expr(out);
+            expect(')', "Expected ')' after condition");
+            Block body = block(out);
+            Block orelse;
+            if (at_keyword(ELSE_KEYWORD)) {
+                advance();
+                if (at_keyword(IF_KEYWORD)) {
+                    size_t start = parts.size();
+                    statement(out);
+                    orelse = close_block(out, start);
+                } else {
+                    orelse = block(out);
+                }
+            }
+            parts.push_back(out.add({Statement::IF, -1, condition, -1, body, orelse}));
+        } else if (at_keyword(WHILE_KEYWORD)) {  // while (condition) {...}
+            advance();
+            expect('(', "Expected '(' after while");
+            int condition = expr(out);
+            expect(')', "Expected ')' after condition");
+            Block body = block(out);
+            parts.push_back(out.add({Statement::WHILE, -1, condition, -1, body, {}}));
+        } else if (at_keyword(FOR_KEYWORD)) {  // for (init; condition; step) {...}
+            // Lowered to init followed by while (condition) { ...; step }
+            advance();
+            expect('(', "Expected '(' after for");
+            if (!at(';')) simple_statement(out);
+            expect(';', "Expected ';' after for initializer");
+            int condition = at(';') ? out.add({Node::NUMBER, 1, -1, -1}) : expr(out);
+            expect(';', "Expected ';' after for condition");
+            size_t start = parts.size();
+            if (!at(')')) simple_statement(out);
+            expect(')', "Expected ')' after for clauses");
+            size_t body = parts.size();
+            block_statements(out);
+            std::rotate(parts.begin() + start, parts.begin() + body, parts.end());  // Step after the body
+            Block loop = close_block(out, start);
+            parts.push_back(out.add({Statement::WHILE, -1, condition, -1, loop, {}}));
+        } else if (at_keyword(RETURN_KEYWORD)) {
+            if (!in_function) error("return outside of a function");
+            advance();
+            parts.push_back(out.add({Statement::RETURN, -1, expr(out), -1, {}, {}}));
+        } else {
+            simple_statement(out);
+        }
+    }
+
+    // Whether a function declaration starts here. "memo" is only a keyword
+    // right before "function".
+    bool at_declaration() const {
+        if (at_keyword(FUNCTION_KEYWORD)) return true;
+        const Token& next = tokens[pos + 1];
+        return at_keyword(MEMO_KEYWORD) && next.kind == Token::IDENTIFIER && next.value == FUNCTION_KEYWORD;
+    }
+
+    // "[memo] function name(parameter, ...) {...}" into func; returns the
+    // name. A memo function caches its results, so it must not change any
+    // global or array.
+    int function_declaration(Function& func) {
+        if (at_keyword(MEMO_KEYWORD)) {
+            func.memo = true;
+            advance();
+        }
+        advance();
+        int func_name = identifier("Expected function name");
+        if (is_builtin(func_name)) error("Cannot redefine built-in function: " + names[func_name]);
+        expect('(', "Expected '(' for function declaration");
+
+        scope.clear();
+        if (!at(')')) {
+            while (true) {
+                int parameter = identifier("Expected parameter name");
+                for (int existing : scope) {
+                    if (existing == parameter) error("Duplicate parameter name: " + names[parameter]);
+                }
+                scope.push_back(parameter);
+                if (at(')')) break;
+                expect(',', "Expected ',' between parameters");
+            }
+        }
+        advance();
+
+        // Parameters resolve to frame slots, every other name to a global
+        in_function = true;
+        func.body = block(func.code);
+        in_function = false;
+        func.parameters.assign(scope.begin(), scope.end());
+        scope.clear();
+        if (func.memo) {
+            int written = written_name(func);
+            if (written >= 0) error("Memo function must not change " + names[written]);
+        }
+        return func_name;
+    }
+
+    // Bind func_name to a copy of func. Declaring the same function again,
+    // as a re-run script does, changes nothing and keeps its memo results.
+    void define(int func_name, const Function& func) {
+        Symbol& symbol = symbols[func_name];
+        if (symbol.function < 0) {
+            symbol.function = static_cast<int>(functions.size());
+            functions.push_back(std::make_shared<const Function>(func));
+            memos.emplace_back();
+        } else if (*functions[symbol.function] == func) {
+            return;
+        } else {
+            functions[symbol.function] = std::make_shared<const Function>(func);
+            memos[symbol.function] = Memo();
+        }
+        definitions++;
+    }
+
+    void end_statement() {
+        if (at(';')) {
+            advance();
+        } else if (current().kind != Token::END && !after_block()) {
+            error("Expected ';' after statement");
+        }
+    }
+
+    // Parse and run top-level statements one at a time
+    void program() {
+        while (current().kind != Token::END) {
+            if (at_declaration()) {
+                declaring.code.clear();
+                declaring.memo = false;
+                int name = function_declaration(declaring);
+                define(name, declaring);
+            } else {
+                scratch.clear();
+                size_t start = parts.size();
+                statement(scratch);
+                int result = 0;
+                execute(scratch, close_block(scratch, start), result);
+            }
+            end_statement();
+        }
+    }
+
+    // A whole program parsed without running it, for BytecodeCompiler
+    struct Parsed {
+        Code code;   // Top-level statements
+        Block main;
+        std::vector<std::pair<int, Function>> functions;  // Declarations by interned name, in order
+        std::vector<int> declared;  // Top-level nodes parsed before each declaration
+    };
+
+    void parse(std::string_view text, Parsed& out) {
+        tokenize(text);
+        pos = 0;
+        in_function = false;
+        scope.clear();
+        parts.clear();
+        while (current().kind != Token::END) {
+            if (at_declaration()) {
+                Function func;
+                int name = function_declaration(func);
+                out.functions.emplace_back(name, std::move(func));
+                out.declared.push_back(static_cast<int>(out.code.nodes.size()));
+            } else {
+                statement(out.code);
+            }
+            end_statement();
+        }
+        out.main = close_block(out.code, 0);
+    }
+
+    friend class BytecodeCompiler;
+
+public:
+    Interpreter() {
+        // Same order as Keyword, then Builtin
+        for (const char* keyword : {"function", "array", "if", "else", "while", "for", "return",
+                                    "memo", "fill", "copy", "sum", "dot", "map"}) {
+            intern(keyword);
+        }
+    }
+
+    // Value of a global variable after interpret(), e.g. to check a result
+    int get_variable(const std::string& name) const {
+        auto it = name_index.find(name);
+        if (it == name_index.end() || !symbols[it->second].assigned) {
+            throw std::out_of_range("Undefined variable: " + name);
+        }
+        return symbols[it->second].value;
+    }
+
+    // Parse and run text, throwing runtime_error on the first error.
+    // Statements before it keep their effects.
+    void run(std::string_view text) {
+        tokenize(text);
+        pos = 0;
+        in_function = false;
+        scope.clear();
+        parts.clear();  // An error may have left lists half parsed
+        memo_args.clear();
+        stack.clear();
+        frame = 0;
+        depth = 0;
+        program();
+    }
+
+    void interpret(std::string_view text) {
+        try {
+            run(text);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    // Return to the state of base, e.g. an Interpreter that ran a shared
+    // prelude, reusing this one's storage rather than allocating anew.
+    // Functions are shared with base, not copied.
+    void reset(const Interpreter& base) {
+        if (this != &base) *this = base;
+    }
+
+    // Incremental input, e.g. from a pipe: each top-level statement runs as
+    // soon as its ';' arrives, and chunks may split it anywhere. A statement
+    // ending in '}' without ';' waits for the next ';' or for finish().
+    void feed(std::string_view chunk) {
+        pending.append(chunk);
+        size_t start = 0;
+        for (size_t i = scanned; i < pending.size(); i++) {
+            char c = pending[i];
+            if (c == '(' || c == '[' || c == '{') {
+                nesting++;
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (nesting > 0) nesting--;  // A stray one is left for the parser to report
+            } else if (c == ';' && nesting == 0) {
+                interpret(std::string_view(pending).substr(start, i + 1 - start));
+                start = i + 1;
+            }
+        }
+        pending.erase(0, start);
+        scanned = pending.size();
+    }
+
+    // Run whatever feed() still holds, at the end of the input
+    void finish() {
+        interpret(pending);
+        pending.clear();
+        scanned = 0;
+        nesting = 0;
+    }
+};
+
+#endif  // INTERPRETER_H
@@ -0,0 +1,96 @@
+#ifndef SCRIPT_SERVICE_H
+#define SCRIPT_SERVICE_H
+
+// Runs many small Interpreter scripts concurrently on a WorkerPool, for
+// callers that would otherwise start a process per script.
+//
+// Every script starts from the state a shared prelude left behind, usually
+// function declarations. The prelude runs once; each script gets a pooled
+// Interpreter that is reset to that state, which reuses its storage and
+// shares the compiled prelude functions read-only instead of copying them.
+// Scripts cannot see each other's variables, arrays or memo caches.
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "interpreter.h"
+#include "virtualMachine.h"
+
+struct ScriptReport {
+    std::string error;  // Empty when the script ran to completion
+    std::chrono::nanoseconds queued{0};  // From submit() until a worker picked it up
+    std::chrono::nanoseconds ran{0};     // Reset, parse and execution
+};
+
+class ScriptService {
+public:
+    // Called on the worker thread when a script has finished, with the
+    // Interpreter still holding the script's final state
+    using Callback = std::function<void(const Interpreter&, const ScriptReport&)>;
+
+    // Runs prelude first, throwing runtime_error if it fails
+    explicit ScriptService(std::string_view prelude = {}, unsigned threads = std::thread::hardware_concurrency())
+        : pool(threads) {
+        base.run(prelude);
+    }
+
+    unsigned threads() const {
+        return pool.size();
+    }
+
+    // Queue script to run on the pool; done may be empty
+    void submit(std::string script, Callback done) {
+        auto submitted = std::chrono::steady_clock::now();
+        pool.submit([this, script = std::move(script), done = std::move(done), submitted] {
+            auto started = std::chrono::steady_clock::now();
+            ScriptReport report;
+            report.queued = started - submitted;
+            std::unique_ptr<Interpreter> interpreter = acquire();
+            interpreter->reset(base);
+            try {
+                interpreter->run(script);
+            } catch (const std::exception& e) {
+                report.error = e.what();
+            }
+            report.ran = std::chrono::steady_clock::now() - started;
+            if (done) done(*interpreter, report);
+            release(std::move(interpreter));
+        });
+    }
+
+    // Block until every submitted script has finished. Rethrows the first
+    // exception a callback raised.
+    void wait() {
+        pool.wait();
+    }
+
+private:
+    Interpreter base;  // State after the prelude; only read once workers run
+    std::mutex idle_lock;
+    std::vector<std::unique_ptr<Interpreter>> idle;  // Interpreters free for the next script
+    WorkerPool pool;  // Last, so queued scripts finish before the members above go
+
+    std::unique_ptr<Interpreter> acquire() {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            if (!idle.empty()) {
+                std::unique_ptr<Interpreter> interpreter = std::move(idle.back());
+                idle.pop_back();
+                return interpreter;
+            }
+        }
+        return std::make_unique<Interpreter>();  // At most one per worker
+    }
+
+    void release(std::unique_ptr<Interpreter> interpreter) {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        idle.push_back(std::move(interpreter));
+    }
+};
+
+#endif  // SCRIPT_SERVICE_H
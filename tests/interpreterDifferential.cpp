@@ -0,0 +1,284 @@
+// Differential checks for the Interpreter: every script must leave the same
+// "result", or fail with the same error, whether the tree-walking
+// Interpreter runs it or BytecodeCompiler lowers it to the VM, with and
+// without the VM optimizer and JIT. Memo functions must give the results
+// of plain ones however their dependencies change.
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bytecodeCompiler.h"
+#include "interpreter.h"
+
+namespace {
+
+std::string interpreted(const std::string& script) {
+    Interpreter interpreter;
+    try {
+        interpreter.run(script);
+        return std::to_string(interpreter.get_variable("result"));
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+}
+
+std::string compiled(const std::string& script, bool optimize, bool tiered) {
+    try {
+        CompiledScript compiled = BytecodeCompiler().compile(script, optimize);
+        VirtualMachine vm(compiled.static_cells + 4096);
+        vm.setMaxCallDepth(BytecodeCompiler::defaultCallDepth);
+        vm.setTiered(tiered, 1);
+        compiled.run(vm);
+        return std::to_string(compiled.get_variable(vm, "result"));
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+}
+
+// Feed script in chunks of random length, as a pipe would deliver it
+std::string streamed(const std::string& script, std::mt19937& rng) {
+    Interpreter interpreter;
+    std::streambuf* saved = std::cerr.rdbuf(nullptr);  // feed() reports errors itself
+    for (size_t pos = 0; pos < script.size();) {
+        size_t length = 1 + rng() % 16;
+        interpreter.feed(std::string_view(script).substr(pos, length));
+        pos += length;
+    }
+    interpreter.finish();
+    std::cerr.rdbuf(saved);
+    try {
+        return std::to_string(interpreter.get_variable("result"));
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+}
+
+bool check(const std::string& name, const std::string& script, std::mt19937& rng) {
+    const std::string expected = interpreted(script);
+    const bool failed = expected.rfind("Error: ", 0) == 0;
+    const std::pair<const char*, std::string> variants[] = {
+        {"--vm", compiled(script, true, false)},
+        {"--vm unoptimized", compiled(script, false, false)},
+        {"--vm JIT", compiled(script, true, true)},
+        // Fed statements run one by one, so those after an error still run
+        {"feed", failed ? expected : streamed(script, rng)},
+    };
+    bool ok = true;
+    for (const auto& variant : variants) {
+        if (variant.second != expected) {
+            std::cerr << name << ": " << variant.first << " gives \"" << variant.second
+                      << "\", Interpreter \"" << expected << "\"\n";
+            ok = false;
+        }
+    }
+    if (!ok) std::cerr << "    " << script << "\n";
+    return ok;
+}
+
+struct Expected {
+    std::string name;
+    std::string script;
+    std::string result;
+    bool compiles = true;  // False for what BytecodeCompiler rejects, e.g. redeclarations
+};
+
+bool expect(const Expected& expected, std::mt19937& rng) {
+    std::string actual = interpreted(expected.script);
+    if (actual != expected.result) {
+        std::cerr << expected.name << ": Interpreter gives \"" << actual << "\", expected \"" << expected.result
+                  << "\"\n    " << expected.script << "\n";
+        return false;
+    }
+    return !expected.compiles || check(expected.name, expected.script, rng);
+}
+
+const std::vector<std::pair<std::string, std::string>> scripts = {
+    {"arithmetic", "x = 7; y = 3; result = x * y - x / y + (x > y) + (x == 7) - (y != 3)"},
+    {"negative division", "result = (0 - 7) / 2 * 100 + 7 / (0 - 2)"},
+    {"loops", "s = 0; for (i = 0; i < 10; i = i + 1) { j = i; while (j > 0) { s = s + j; j = j - 2 } }; result = s"},
+    {"arrays", "array a[5]; for (i = 0; i < 5; i = i + 1) { a[i] = i * i }; result = a[4] + a[a[2]]"},
+    {"recursion", "function fib(n) { if (n < 2) { return n }; fib(n - 1) + fib(n - 2) }; result = fib(15)"},
+    {"globals in functions", "k = 4; function f(x) { k = k + x; k * 2 }; a = f(1); result = f(a) + k"},
+    {"callee declared after caller",
+     "function f(x) { if (x > 0) { return g(x - 1) }; 0 }; function g(x) { f(x) + 1 }; result = f(5)"},
+    {"early return", "function f(x) { if (x > 3) { return 1 } else { return 2 }; 3 }; result = f(5) * 10 + f(1)"},
+    {"builtins",
+     "array a[6]; array b[6]; fill(a, 3); a[2] = 9; copy(b, a); function sq(x) { x * x }; "
+     "map(b, b, sq); result = sum(a) * 1000 + dot(a, b)"},
+    {"division by zero", "x = 0; result = 5 / x"},
+    {"index out of bounds", "array a[3]; result = a[3]"},
+    {"negative array size", "n = 0 - 1; array a[n]; result = 1"},
+    {"size mismatch", "array a[3]; array b[4]; copy(a, b); result = 1"},
+    {"call depth", "function f(x) { f(x + 1) }; result = f(0)"},
+};
+
+// Keywords are whole identifiers: names that merely start with one, such as
+// those beginning with 'f' or 'a', are ordinary globals, arrays and functions
+const std::vector<Expected> keywordScripts = {
+    {"declarations", "function add(a, b) { a + b }; array arr[3]; arr[1] = add(2, 3); result = arr[1]", "5"},
+    {"keyword prefixes",
+     "functional = 2; apple = 3; array2 = 4; iffy = 5; format = 6; whiled = 7; returned = 8; "
+     "result = functional + apple + array2 + iffy + format + whiled + returned", "35"},
+    {"functions and arrays named like keywords",
+     "function fun(x) { x * 2 }; function arrays(x) { x + 1 }; array ax[2]; array fa[2]; ax[0] = fun(3); "
+     "fa[1] = arrays(ax[0]); result = fa[1]", "7"},
+    {"memo and builtin names as globals", "memo = 3; sum = 4; fill = 5; result = memo * 100 + sum * 10 + fill", "345"},
+    {"keyword as a name", "function = 1; result = 1", "Error: Expected function name"},
+    {"builtin as a function name", "function sum(a) { a }; result = 1", "Error: Cannot redefine built-in function: sum"},
+};
+
+// Memo functions whose cached results must track their dependencies
+const std::vector<Expected> memoScripts = {
+    {"memo global read",
+     "k = 2; memo function f(x) { x * k }; a = f(5); k = 3; b = f(5); result = a * 100 + b", "1015"},
+    {"memo callee and array",
+     "array t[4]; t[1] = 10; function g(x) { x + t[1] }; memo function f(x) { g(x) * 2 }; a = f(1); "
+     "t[1] = 20; b = f(1); fill(t, 5); c = f(1); result = a * 10000 + b * 100 + c", "224212"},
+    {"memo callee redeclared",
+     "function g(x) { x + 1 }; memo function f(x) { g(x) * 2 }; a = f(1); function g(x) { x }; b = f(1); "
+     "result = a * 10 + b", "42", false},
+    {"memo callee redeclared unchanged",
+     "function g(x) { x + 1 }; memo function f(x) { g(x) * 2 }; a = f(1); function g(x) { x + 1 }; b = f(1); "
+     "function g(x) { x + 2 }; c = f(1); memo function f(x) { g(x) * 2 }; d = f(2); "
+     "result = a * 1000 + b * 100 + c * 10 + d", "4468", false},
+    {"memo without parameters",
+     "k = 5; memo function five() { k }; a = five(); k = 6; result = a * 10 + five() + five()", "62"},
+    {"memo builtin dependency",
+     "array t[4]; function g(x) { x + sum(t) }; memo function f(x) { g(x) }; a = f(1); t[0] = 4; "
+     "b = f(1); map(t, t, f); result = a * 100 + b * 10 + t[0]", "158"},
+    {"memo parameter assignment",
+     "memo function f(a, b) { a = a * 7 + b; a - b / 3 }; function p(a, b) { a = a * 7 + b; a - b / 3 }; "
+     "bad = 0; for (r = 0; r < 2; r = r + 1) { for (i = 0; i < 3000; i = i + 1) { "
+     "if (f(i, i / 3) != p(i, i / 3)) { bad = bad + 1 }; if (f(i / 2, 5) != p(i / 2, 5)) { bad = bad + 1 } } }; "
+     "result = bad", "0"},
+};
+
+// The Interpreter's own overflow errors; compiled scripts compute in 64-bit
+// registers instead
+const std::vector<Expected> overflowScripts = {
+    {"INT_MIN / -1", "x = 0 - 2147483647 - 1; y = 0 - 1; result = x / y", "Error: Integer overflow in division", false},
+    {"INT_MIN / 1", "x = 0 - 2147483647 - 1; result = x / 1 + 1", "-2147483647"},
+};
+
+// Impure memo functions and calls to functions not yet declared, which
+// must be rejected however they are run
+const std::vector<Expected> rejected = {
+    {"call before declaration", "result = f(1); function f(x) { x + 1 }", "Error: Undefined function: f"},
+    {"callee declared after call",
+     "function f(x) { g(x) }; result = f(1); function g(x) { x + 1 }", "Error: Undefined function: g"},
+    {"map before declaration", "array t[2]; m = map(t, t, f); function f(x) { x }; result = m",
+     "Error: Undefined function: f"},
+    {"impure memo", "memo function f(x) { y = x; x }; result = f(1)", "Error: Memo function must not change y"},
+    {"impure memo callee", "function w(a) { g = a }; memo function f(a) { w(a) }; result = f(1)",
+     "Error: Memo function calls a function that changes g"},
+    {"impure memo indirect callee",
+     "array t[2]; function v(a) { fill(t, a) }; function w(a) { v(a) + 1 }; memo function f(a) { w(a) }; "
+     "result = f(1)", "Error: Memo function calls a function that changes t"},
+};
+
+// "result = 1 + (2 + (3 + ... + count))", through f(x) = x when calls is set
+std::string nested(int count, bool calls) {
+    std::string text = calls ? "function f(x) { x }; result = " : "result = ";
+    for (int i = 1; i <= count; i++) {
+        std::string term = calls ? "f(" + std::to_string(i) + ")" : std::to_string(i);
+        text += i < count ? term + " + (" : term + std::string(count - 1, ')');
+    }
+    return text;
+}
+
+// A random script of bounded-value arithmetic over globals, an array, two
+// helper functions, loops and the builtins. Products only scale by small
+// constants, so no value comes near overflowing int.
+class ScriptGenerator {
+    std::mt19937& rng;
+
+    int pick(int n) {
+        return static_cast<int>(rng() % static_cast<unsigned>(n));
+    }
+
+    std::string expression(int depth, const std::vector<std::string>& variables) {
+        if (depth == 0 || pick(10) < 3) {
+            int choice = pick(10);
+            if (choice < 4) return std::to_string(pick(21));
+            if (choice < 8) return variables[pick(static_cast<int>(variables.size()))];
+            return "arr[" + std::to_string(pick(8)) + "]";
+        }
+        static const char* const operators[] = {"+", "-", "<", ">", "==", "!=", "<=", ">="};
+        switch (pick(6)) {
+            case 0:
+                return "g(" + expression(depth - 1, variables) + ", " + expression(depth - 1, variables) + ")";
+            case 1:
+                return "(" + expression(depth - 1, variables) + ") / (" + expression(depth - 1, variables) + " * 3 + 1)";
+            case 2:
+                return "(" + expression(depth - 1, variables) + ") * " + std::to_string(pick(4));
+            default:
+                return "(" + expression(depth - 1, variables) + " " + operators[pick(8)] + " " +
+                       expression(depth - 1, variables) + ")";
+        }
+    }
+
+public:
+    explicit ScriptGenerator(std::mt19937& rng) : rng(rng) {}
+
+    std::string script() {
+        std::string text = "function g(a, b) { if (a > b) { return a - b }; a * 2 + b }; ";
+        text += "function h(p, q, r) { s = 0; while (p < r) { s = s + " + expression(2, {"p", "q", "r"}) +
+                "; p = p + 1 }; s + q }; ";
+        text += "array arr[8]; x = " + std::to_string(pick(10)) + "; y = " + std::to_string(pick(10)) + "; ";
+        for (int i = 0; i < 8; i++) {
+            text += "arr[" + std::to_string(i) + "] = " + expression(2, {"x", "y"}) + "; ";
+        }
+        text += "for (i = 0; i < 5; i = i + 1) { x = x + " + expression(3, {"x", "y", "i"}) +
+                "; if (x > 50) { x = x - 40 } else { y = y + 1 } }; ";
+        text += "array brr[8]; function k(v) { v * 3 - x }; m = map(brr, arr, k); "
+                "z = sum(brr) + dot(arr, brr) + fill(arr, y) + copy(brr, arr) + sum(brr); ";
+        text += "result = z + " + expression(3, {"x", "y"}) + " + h(x - (x / 7) * 7, y, 9)";
+        return text;
+    }
+};
+
+}  // namespace
+
+int main() {
+    std::mt19937 rng(2024);
+    int failures = 0;
+    for (const auto& script : scripts) {
+        failures += !check(script.first, script.second, rng);
+    }
+    for (const auto& script : keywordScripts) {
+        failures += !expect(script, rng);
+    }
+    for (const auto& script : memoScripts) {
+        failures += !expect(script, rng);
+    }
+    for (const auto& script : overflowScripts) {
+        failures += !expect(script, rng);
+    }
+    for (const auto& script : rejected) {
+        failures += !expect(script, rng);
+    }
+    // Inert operands are evaluated right to left, so nesting needs no more
+    // registers. Each pending call result holds one, and top-level code
+    // keeps result in R1, leaving R2 upwards for temporaries.
+    for (int count : {registerCount, 4 * registerCount}) {
+        failures += !expect({"nested sum", nested(count, false), std::to_string(count * (count + 1) / 2)}, rng);
+    }
+    const int deepest = registerCount - 2;
+    failures += !expect({"nested calls", nested(deepest, true), std::to_string(deepest * (deepest + 1) / 2)}, rng);
+    const std::string too_deep = compiled(nested(deepest + 1, true), true, false);
+    if (too_deep != "Error: Expression needs more than " + std::to_string(registerCount) + " VM registers") {
+        std::cerr << "nested calls: --vm gives \"" << too_deep << "\" one level deeper\n";
+        failures++;
+    }
+    ScriptGenerator generator(rng);
+    for (int i = 0; i < 300; i++) {
+        failures += !check("random script " + std::to_string(i), generator.script(), rng);
+    }
+    if (failures > 0) {
+        std::cerr << failures << " scripts differ" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,280 @@
+// Differential checks for the VM: every program must print the same output
+// and stop with the same trap whether it runs as assembled, after
+// Program::optimize(), under the tiered JIT, or after a round trip through
+// the binary bytecode format.
+
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "virtualMachine.h"
+
+namespace {
+
+struct Outcome {
+    std::string output;
+    Trap trap = Trap::None;
+    std::vector<int64_t> registers;  // At the end or the trap; empty to ignore them
+    std::vector<int32_t> heap;  // Likewise
+
+    bool operator==(const Outcome& other) const {
+        return output == other.output && trap == other.trap &&
+               (registers.empty() || other.registers.empty() || registers == other.registers) &&
+               (heap.empty() || other.heap.empty() || heap == other.heap);
+    }
+};
+
+Outcome execute(const std::shared_ptr<const Program>& program, bool tiered,
+                OverflowMode overflow = OverflowMode::Wrap) {
+    const size_t heapSize = 256;
+    VirtualMachine vm(program, heapSize);
+    StringSink sink;
+    vm.setOutput(sink);
+    vm.setTiered(tiered, 1);  // Compile every region on its first hit
+    vm.setOverflowMode(overflow);
+    Outcome outcome;
+    outcome.trap = vm.start();
+    outcome.output = sink.str();
+    for (int reg = 0; reg < registerCount; ++reg) {
+        outcome.registers.push_back(vm.getRegister(reg));
+    }
+    for (size_t address = 0; address < heapSize; ++address) {
+        outcome.heap.push_back(vm.getMemory(address));
+    }
+    return outcome;
+}
+
+std::shared_ptr<Program> assemble(const std::vector<std::string>& source, bool optimize) {
+    auto program = std::make_shared<Program>();
+    program->load(source);
+    if (optimize) {
+        program->optimize();
+    }
+    return program;
+}
+
+std::shared_ptr<Program> roundTrip(const Program& program, const std::string& path) {
+    program.save(path);
+    auto loaded = std::make_shared<Program>();
+    loaded->loadBinary(path);
+    return loaded;
+}
+
+std::string describe(const Outcome& outcome) {
+    std::string text = outcome.output;
+    for (char& c : text) {
+        if (c == '\n') c = ' ';
+    }
+    text = "[" + text + "] " + trapMessage(outcome.trap);
+    for (size_t reg = 0; reg < outcome.registers.size(); ++reg) {
+        if (outcome.registers[reg] != 0) text += " R" + std::to_string(reg) + "=" + std::to_string(outcome.registers[reg]);
+    }
+    return text;
+}
+
+// Compare every way of running source against the plain interpreted run
+bool check(const std::string& name, const std::vector<std::string>& source, const std::string& binaryPath,
+           OverflowMode overflow = OverflowMode::Wrap) {
+    auto plain = assemble(source, false);
+    auto optimized = assemble(source, true);
+    const Outcome expected = execute(plain, false, overflow);
+    const std::pair<const char*, Outcome> variants[] = {
+        {"-O", execute(optimized, false, overflow)},
+        {"JIT", execute(plain, true, overflow)},
+        {"-O JIT", execute(optimized, true, overflow)},
+        {"VMBC", execute(roundTrip(*plain, binaryPath), false, overflow)},
+        {"-O VMBC", execute(roundTrip(*optimized, binaryPath), false, overflow)},
+    };
+    bool ok = true;
+    for (const auto& variant : variants) {
+        if (!(variant.second == expected)) {
+            std::cerr << name << ": " << variant.first << " gives " << describe(variant.second)
+                      << ", plain run " << describe(expected) << "\n";
+            ok = false;
+        }
+    }
+    if (!ok) {
+        for (const std::string& line : source) {
+            std::cerr << "    " << line << "\n";
+        }
+    }
+    return ok;
+}
+
+// Check the plain run of source against a known outcome, then the others
+bool expect(const std::string& name, const std::vector<std::string>& source, const Outcome& expected,
+            const std::string& binaryPath, OverflowMode overflow = OverflowMode::Wrap) {
+    const Outcome actual = execute(assemble(source, false), false, overflow);
+    if (!(actual == expected)) {
+        std::cerr << name << ": plain run gives " << describe(actual) << ", expected " << describe(expected) << "\n";
+        return false;
+    }
+    return check(name, source, binaryPath, overflow);
+}
+
+// INT64_MIN divided by and modulo -1, in a loop so the JIT compiles it
+const std::vector<std::string> minOverMinusOne = {
+    "MOV R0 -9223372036854775807", "MOV R1 1", "SUB R0 R1", "MOV R2 -1", "MOV R3 2", "MOV R5 0",
+    "loop:", "MOV R4 0", "ADD R4 R0", "MOD R4 R2", "PRINT R4", "MOV R4 0", "ADD R4 R0", "DIV R4 R2", "PRINT R4",
+    "SUB R3 R1", "JEQ R3 R5 done", "JMP loop", "done:"};
+
+// ADD, SUB and MUL past the int64 range, plain and fused with a JEQ, in a
+// loop so the JIT compiles them
+const std::vector<std::string> overflowing = {
+    "MOV R0 9223372036854775807", "MOV R1 1", "MOV R3 2", "MOV R5 0",
+    "loop:", "ADD R0 R1", "PRINT R0", "SUB R0 R1", "PRINT R0", "MOV R2 0", "ADD R2 R0", "MUL R2 R3", "PRINT R2",
+    "MOV R4 0", "ADD R4 R0", "ADD R4 R1", "JEQ R4 R5 done", "PRINT R4",
+    "SUB R3 R1", "JEQ R3 R5 done", "JMP loop", "done:"};
+
+// Hand-written programs covering each optimizer rewrite and trap
+const std::vector<std::pair<std::string, std::vector<std::string>>> programs = {
+    {"fold and fuse", {
+        "MOV R0 6", "MOV R1 7", "MUL R0 R1", "MOV R2 0", "MOV R3 1",
+        "loop:", "SUB R0 R3", "EQ R2 R2", "JEQ R0 R2 done", "PRINT R0", "JMP loop",
+        "done:", "PRINT R0"}},
+    {"jump threading", {
+        "MOV R0 1", "JMP a", "a:", "JMP b", "PRINT R0", "b:", "MOV R0 2", "JMP c", "c:", "PRINT R0"}},
+    {"dead MOV", {"MOV R0 1", "MOV R0 2", "MOV R1 3", "ADD R0 R1", "PRINT R0"}},
+    {"heap", {
+        "MOV R0 42", "STORE R0 3", "MOV R1 0", "LOAD R1 3", "PRINT R1",
+        "MOV R2 5", "STORE R1 [R2+4]", "LOAD R3 9", "PRINT R3",
+        "MOV R4 10", "MOV R5 7", "MEMSET R4 R5 R2", "LOAD R0 14", "PRINT R0"}},
+    {"call window", {
+        "MOV R0 5", "MOV R1 9", "CALL f R1 R1", "PRINT R0", "PRINT R1", "JMP end",
+        "f:", "MOV R1 100", "ADD R0 R1", "RET", "end:"}},
+    {"large constants", {"MOV R0 5000000000", "MOV R1 3", "MUL R0 R1", "PRINT R0"}},
+    {"store truncates", {
+        "MOV R0 5000000000", "STORE R0 0", "LOAD R0 0", "PRINT R0",
+        "MOV R1 3", "MOV R2 4000000000", "STORE R2 [R1+1]", "LOAD R2 [R1+1]", "PRINT R2"}},
+    {"division by zero", {"MOV R0 1", "MOV R1 0", "PRINT R0", "DIV R0 R1", "PRINT R0"}},
+    {"dead MOV before a trap", {
+        "MOV R2 5", "MOV R3 6", "MOV R1 0", "DIV R0 R1", "MOV R2 7", "LOAD R3 100000", "MOV R3 8", "PRINT R2"}},
+    {"dead MOV before a failing load", {"MOV R0 1", "MOV R2 4", "LOAD R1 100000", "MOV R2 5", "PRINT R2"}},
+    {"modulus by zero in a loop", {
+        "MOV R0 3", "MOV R1 1", "MOV R2 7",
+        "loop:", "PRINT R0", "SUB R0 R1", "MOD R2 R0", "JMP loop"}},
+    {"invalid address", {"MOV R0 1", "STORE R0 100000", "PRINT R0"}},
+    {"return from empty stack", {"MOV R0 1", "RET", "PRINT R0"}},
+};
+
+// A random program of bounded-value arithmetic, comparisons, heap traffic
+// and PRINTs inside a counted loop
+std::vector<std::string> randomProgram(std::mt19937& rng) {
+    auto pick = [&](int n) { return static_cast<int>(rng() % static_cast<unsigned>(n)); };
+    auto reg = [&](int n) { return "R" + std::to_string(pick(n)); };
+    std::vector<std::string> source;
+    for (int r = 0; r < 6; ++r) {
+        source.push_back("MOV R" + std::to_string(r) + " " + std::to_string(pick(41) - 20));
+    }
+    source.push_back("MOV R6 " + std::to_string(1 + pick(8)));  // Iterations
+    source.push_back("MOV R7 1");
+    source.push_back("MOV R8 0");
+    source.push_back("loop:");
+    const int length = 3 + pick(10);
+    for (int i = 0; i < length; ++i) {
+        switch (pick(9)) {
+            case 0: source.push_back("MOV " + reg(6) + " " + std::to_string(pick(201) - 100)); break;
+            case 1: source.push_back("ADD " + reg(6) + " " + reg(6)); break;
+            case 2: source.push_back("SUB " + reg(6) + " " + reg(6)); break;
+            case 3: source.push_back((pick(2) ? "DIV " : "MOD ") + reg(6) + " " + reg(6)); break;
+            case 4: source.push_back(std::string(pick(2) ? "GT " : pick(2) ? "LT " : "EQ ") + reg(6) + " " + reg(6)); break;
+            case 5: source.push_back("STORE " + reg(6) + " " + std::to_string(pick(16))); break;
+            case 6: source.push_back("LOAD " + reg(6) + " " + std::to_string(pick(16))); break;
+            case 7: source.push_back("PRINT " + reg(6)); break;
+            default: source.push_back("MOV R" + std::to_string(pick(6)) + " " + std::to_string(pick(9))); break;
+        }
+    }
+    source.push_back("SUB R6 R7");
+    source.push_back("JEQ R6 R8 done");
+    source.push_back("JMP loop");
+    source.push_back("done:");
+    source.push_back("PRINT R0");
+    return source;
+}
+
+// Jobs of runBatch starting from a warm snapshot of another program must see
+// its heap, print what a single run prints and keep their compiled regions
+bool checkWarmBatch() {
+    auto setup = assemble({"MOV R0 7", "STORE R0 3"}, false);
+    auto job = assemble({
+        "LOAD R0 3", "MOV R1 0", "MOV R2 1", "MOV R3 5",
+        "loop:", "ADD R1 R0", "SUB R3 R2", "JEQ R3 R4 done", "JMP loop", "done:", "PRINT R1"}, false);
+    VirtualMachine warmup(setup);
+    warmup.runOrThrow();
+    auto warm = warmup.snapshot();
+
+    const size_t count = 64;
+    std::vector<StringSink> sinks(count);
+    std::vector<size_t> regions(count);
+    WorkerPool pool(1);  // One context runs each batch of consecutive jobs
+    runBatch(pool, job, count,
+             [&](VirtualMachine& vm, size_t index) {
+                 vm.setOutput(sinks[index]);
+                 vm.setTiered(true, 1);
+                 regions[index] = vm.compiledRegions();
+             },
+             nullptr, VirtualMachine::defaultHeapSize, warm);
+
+    bool ok = true;
+    size_t reused = 0;
+    for (size_t index = 0; index < count; ++index) {
+        if (sinks[index].str() != "Register 1: 35\n") {
+            std::cerr << "warm batch: job " << index << " prints [" << sinks[index].str() << "]\n";
+            ok = false;
+        }
+        reused += regions[index] > 0;
+    }
+    if (VM_JIT && reused < count / 2) {
+        std::cerr << "warm batch: only " << reused << " of " << count << " jobs kept their compiled regions\n";
+        ok = false;
+    }
+    return ok;
+}
+
+}  // namespace
+
+int main() {
+    const std::string binaryPath =
+        (std::filesystem::temp_directory_path() / ("vmDifferential-" + std::to_string(::getpid()) + ".vmbc")).string();
+    int failures = 0;
+    for (const auto& program : programs) {
+        failures += !check(program.first, program.second, binaryPath);
+    }
+    const std::string wrapped = "Register 4: 0\nRegister 4: -9223372036854775808\n";
+    failures += !expect("INT64_MIN / -1 wraps", minOverMinusOne, {wrapped + wrapped, Trap::None, {}, {}}, binaryPath);
+    failures += !expect("INT64_MIN / -1 traps", minOverMinusOne, {"Register 4: 0\n", Trap::IntegerOverflow, {}, {}},
+                        binaryPath, OverflowMode::Trap);
+    const std::string wrappedOnce = "Register 0: -9223372036854775808\nRegister 0: 9223372036854775807\n"
+                                    "Register 2: -2\nRegister 4: -9223372036854775808\n";
+    failures += !expect("overflow wraps", overflowing,
+                        {wrappedOnce + "Register 0: -9223372036854775808\nRegister 0: 9223372036854775807\n"
+                                       "Register 2: 9223372036854775807\nRegister 4: -9223372036854775808\n",
+                         Trap::None, {}, {}},
+                        binaryPath);
+    failures += !expect("overflow traps", overflowing, {"", Trap::IntegerOverflow, {}, {}}, binaryPath,
+                        OverflowMode::Trap);
+    const std::pair<const char*, std::vector<std::string>> traps[] = {
+        {"SUB overflow traps", {"MOV R0 -9223372036854775807", "MOV R1 2", "PRINT R1", "SUB R0 R1", "PRINT R0"}},
+        {"MUL overflow traps", {"MOV R0 4611686018427387904", "MOV R1 2", "PRINT R1", "MUL R0 R1", "PRINT R0"}},
+        {"SUBJEQ overflow traps", {
+            "MOV R0 -9223372036854775807", "MOV R1 2", "MOV R2 0", "PRINT R1", "SUB R0 R1", "JEQ R0 R2 end", "end:"}},
+    };
+    for (const auto& trap : traps) {
+        failures += !expect(trap.first, trap.second, {"Register 1: 2\n", Trap::IntegerOverflow, {}, {}}, binaryPath,
+                            OverflowMode::Trap);
+    }
+    failures += !checkWarmBatch();
+    std::mt19937 rng(2024);
+    for (int i = 0; i < 500; ++i) {
+        failures += !check("random program " + std::to_string(i), randomProgram(rng), binaryPath);
+    }
+    std::remove(binaryPath.c_str());
+    if (failures > 0) {
+        std::cerr << failures << " programs differ" << std::endl;
+        return 1;
+    }
+    return 0;
+}
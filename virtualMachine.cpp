@@ -1,223 +1,71 @@
-#include <iostream>
-#include <vector>
-#include <unordered_map>
-#include <stack>
-#include <sstream>
-#include <cmath>
-#include <stdexcept>
+#include "virtualMachine.h"
 
-class VirtualMachine {
-public:
-    VirtualMachine() {
-        // Initialize registers to 0
-        for (int i = 0; i < 6; ++i) {
-            registers[i] = 0;
-        }
-        pc = 0;
-        running = false;
-        memory = new int[100];  // Simulating heap memory
-        stackPointer = 99;  // Top of the stack in memory
-    }
-
-    ~VirtualMachine() {
-        delete[] memory;  // Clean up heap memory
-    }
-
-    // Load bytecode into memory
-    void load(const std::vector<std::string>& bytecode) {
-        program = bytecode;
-    }
-
-    // Run the bytecode
-    void run() {
-        pc = 0;  // Reset program counter
-        running = true;
-        
-        while (running && pc < program.size()) {
-            std::string instruction = program[pc++];
-            try {
-                execute(instruction);
-            } catch (const std::exception& e) {
-                std::cerr << "Error: " << e.what() << std::endl;
-                running = false;
-            }
-        }
-    }
-
-    // Define label and its corresponding program counter
-    void defineLabel(const std::string& label) {
-        labels[label] = program.size();  // Label stores the position in the program
-    }
-
-private:
-    int registers[6];  // Registers R0 to R5
-    int* memory;  // Heap memory (simulated with a simple array)
-    int stackPointer;  // Stack pointer for function calls
-    std::vector<std::string> program;  // Bytecode instructions
-    int pc;  // Program counter
-    bool running;  // VM running status
-    std::stack<int> callStack;  // Stack for function calls
-    std::unordered_map<std::string, int> labels;  // Label addresses
+int main(int argc, char* argv[]) {
+    VirtualMachine vm;
 
-    // Execute a single instruction
-    void execute(const std::string& instruction) {
-        std::string op = instruction.substr(0, 3);  // Operation (e.g., "ADD")
-        
-        if (op == "MOV") {
-            mov(instruction);
-        } else if (op == "ADD") {
-            arithmetic(instruction, "ADD");
-        } else if (op == "SUB") {
-            arithmetic(instruction, "SUB");
-        } else if (op == "MUL") {
-            arithmetic(instruction, "MUL");
-        } else if (op == "DIV") {
-            arithmetic(instruction, "DIV");
-        } else if (op == "MOD") {
-            arithmetic(instruction, "MOD");
-        } else if (op == "EXP") {
-            arithmetic(instruction, "EXP");
-        } else if (op == "GT") {
-            comparison(instruction, "GT");
-        } else if (op == "LT") {
-            comparison(instruction, "LT");
-        } else if (op == "EQ") {
-            comparison(instruction, "EQ");
-        } else if (op == "PRINT") {
-            print(instruction);
-        } else if (op == "JMP") {
-            jump(instruction);
-        } else if (op == "JEQ") {
-            jumpIfEqual(instruction);
-        } else if (op == "CALL") {
-            call(instruction);
-        } else if (op == "RET") {
-            ret();
-        } else if (op == "ALLOC") {
-            alloc(instruction);
-        } else if (op == "STORE") {
-            store(instruction);
-        } else if (op == "LOAD") {
-            loadFromHeap(instruction);
+    // virtualMachine [-O] -c <source> <output>:   assemble a text program to a bytecode file
+    // virtualMachine [-O] -n <count> <program>:  run count independent copies on all cores
+    // virtualMachine [-O] [-J] <program>:        run a text or bytecode program
+    // -O runs the peephole optimizer before saving or running, -J enables
+    // tiered execution with the JIT for single runs, -P <file> writes a
+    // profile of a single run (profiling builds only), and -S <setup> runs a
+    // setup program once and starts every copy of a -n batch from its state.
+    int arg = 1;
+    bool optimize = false;
+    std::string setupPath;
+    for (; arg < argc; ++arg) {
+        std::string option = argv[arg];
+        if (option == "-O") {
+            optimize = true;
+        } else if (option == "-J") {
+            vm.setTiered(true);
+        } else if (option == "-P" && arg + 1 < argc) {
+            vm.setProfileOutput(argv[++arg]);
+        } else if (option == "-S" && arg + 1 < argc) {
+            setupPath = argv[++arg];
         } else {
-            throw std::invalid_argument("Unknown instruction: " + instruction);
+            break;
         }
     }
-
-    void mov(const std::string& instruction) {
-        int reg = instruction[4] - '0';
-        int value = std::stoi(instruction.substr(6));
-        registers[reg] = value;
-    }
-
-    void arithmetic(const std::string& instruction, const std::string& op) {
-        int reg1 = instruction[4] - '0';
-        int reg2 = instruction[6] - '0';
-        
-        if (op == "ADD") {
-            registers[reg1] += registers[reg2];
-        } else if (op == "SUB") {
-            registers[reg1] -= registers[reg2];
-        } else if (op == "MUL") {
-            registers[reg1] *= registers[reg2];
-        } else if (op == "DIV") {
-            if (registers[reg2] == 0) {
-                throw std::runtime_error("Error: Division by zero!");
+    if (arg < argc) {
+        try {
+            std::string mode = argv[arg];
+            if (mode == "-n" || mode == "-c") {
+                if (argc - arg != 3) {
+                    std::cerr << "Usage: " << argv[0] << " [-O] -n <count> <program> | [-O] -c <source> <output>"
+                              << std::endl;
+                    return 2;
+                }
             }
-            registers[reg1] /= registers[reg2];
-        } else if (op == "MOD") {
-            if (registers[reg2] == 0) {
-                throw std::runtime_error("Error: Modulus by zero!");
+            if (mode == "-n") {
+                auto program = loadProgram(argv[arg + 2], optimize);
+                std::shared_ptr<const VirtualMachine::Snapshot> warm;
+                if (!setupPath.empty()) {
+                    VirtualMachine setup(loadProgram(setupPath, optimize));
+                    setup.runOrThrow();
+                    warm = setup.snapshot();
+                }
+                WorkerPool pool;
+                runBatch(pool, program, std::stoul(argv[arg + 1]), nullptr, nullptr,
+                         VirtualMachine::defaultHeapSize, warm);
+            } else if (mode == "-c") {
+                auto program = std::make_shared<Program>();
+                program->load(readSource(argv[arg + 1]));
+                if (optimize) {
+                    program->optimize();
+                }
+                program->save(argv[arg + 2]);
+            } else {
+                vm.attach(loadProgram(mode, optimize));
+                vm.run();
             }
-            registers[reg1] %= registers[reg2];
-        } else if (op == "EXP") {
-            registers[reg1] = std::pow(registers[reg1], registers[reg2]);
-        }
-    }
-
-    void comparison(const std::string& instruction, const std::string& op) {
-        int reg1 = instruction[4] - '0';
-        int reg2 = instruction[6] - '0';
-        bool result = false;
-
-        if (op == "GT") {
-            result = registers[reg1] > registers[reg2];
-        } else if (op == "LT") {
-            result = registers[reg1] < registers[reg2];
-        } else if (op == "EQ") {
-            result = registers[reg1] == registers[reg2];
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
         }
-
-        registers[reg1] = result ? 1 : 0;  // Store boolean result as 1 or 0
-    }
-
-    void print(const std::string& instruction) {
-        int reg = instruction[6] - '0';
-        std::cout << "Register " << reg << ": " << registers[reg] << std::endl;
+        return 0;
     }
 
-    void jump(const std::string& instruction) {
-        std::string label = instruction.substr(4);
-        if (labels.find(label) == labels.end()) {
-            throw std::invalid_argument("Error: Undefined label " + label);
-        }
-        pc = labels[label];
-    }
-
-    void jumpIfEqual(const std::string& instruction) {
-        int reg1 = instruction[4] - '0';
-        int reg2 = instruction[6] - '0';
-        std::string label = instruction.substr(8);
-        
-        if (registers[reg1] == registers[reg2]) {
-            jump("JMP " + label);
-        }
-    }
-
-    void call(const std::string& instruction) {
-        std::string label = instruction.substr(5);
-        callStack.push(pc);
-        if (labels.find(label) == labels.end()) {
-            throw std::invalid_argument("Error: Undefined label " + label);
-        }
-        pc = labels[label];
-    }
-
-    void ret() {
-        if (callStack.empty()) {
-            throw std::runtime_error("Error: Return from empty call stack!");
-        }
-        pc = callStack.top();
-        callStack.pop();
-    }
-
-    void alloc(const std::string& instruction) {
-        int size = std::stoi(instruction.substr(6));
-        if (stackPointer - size < 0) {
-            throw std::runtime_error("Error: Out of memory!");
-        }
-        stackPointer -= size;
-    }
-
-    void store(const std::string& instruction) {
-        int reg = instruction[6] - '0';
-        int addr = std::stoi(instruction.substr(8));
-        memory[addr] = registers[reg];
-    }
-
-    void loadFromHeap(const std::string& instruction) {
-        int reg = instruction[6] - '0';
-        int addr = std::stoi(instruction.substr(8));
-        if (addr < 0 || addr >= 100) {
-            throw std::out_of_range("Error: Invalid memory address!");
-        }
-        registers[reg] = memory[addr];
-    }
-};
-
-int main() {
-    VirtualMachine vm;
-
     // Define bytecode with labels and heap operations
     std::vector<std::string> bytecode = {
         "MOV R0 10",   // Move 10 into R0
@@ -233,12 +81,9 @@ int main() {
         "PRINT R0"     // Print R0 (final value)
     };
 
-    // Load bytecode
+    // Load bytecode (labels are resolved here)
     vm.load(bytecode);
 
-    // Define labels after loading bytecode
-    vm.defineLabel("end");
-
     // Run VM
     vm.run();
 
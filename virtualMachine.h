@@ -0,0 +1,2691 @@
+#ifndef VIRTUAL_MACHINE_H
+#define VIRTUAL_MACHINE_H
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <sstream>
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Direct-threaded dispatch via computed goto where the compiler supports it.
+// Build with -DVM_SWITCH_DISPATCH to force the portable switch loop.
+#if !defined(VM_THREADED_DISPATCH)
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+#endif
+
+// Vector kernels use the widest instruction set the build targets. Build with
+// -DVM_SCALAR_VECTORS to force the portable loops.
+#if !defined(VM_SCALAR_VECTORS) && defined(__AVX2__)
+#include <immintrin.h>
+#define VM_VECTOR_AVX2 1
+#elif !defined(VM_SCALAR_VECTORS) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#define VM_VECTOR_SSE4 1
+#elif !defined(VM_SCALAR_VECTORS) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VM_VECTOR_NEON 1
+#endif
+
+constexpr int vectorLanes = 8;  // int32 lanes per vector register
+constexpr int vectorRegisterCount = 8;  // Vector registers V0 to V7
+
+// Size of the scalar register file. Operands are one byte, so anything from
+// 6 to 256 works; build with e.g. -DVM_REGISTERS=256 for a larger file.
+#if !defined(VM_REGISTERS)
+#define VM_REGISTERS 32
+#endif
+constexpr int registerCount = VM_REGISTERS;  // Scalar registers R0 to R<registerCount - 1>
+static_assert(registerCount >= 6 && registerCount <= 256, "VM_REGISTERS must be between 6 and 256");
+
+struct alignas(32) VectorRegister {
+    int32_t lanes[vectorLanes];
+};
+
+enum class VectorOp { Add, Sub, Mul, CmpEq };
+
+// a = a <op> b lane by lane. CmpEq stores 1 where the lanes are equal, else 0.
+template <VectorOp Op>
+inline void vectorKernel(VectorRegister& a, const VectorRegister& b) {
+#if defined(VM_VECTOR_AVX2)
+    __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a.lanes));
+    __m256i y = _mm256_load_si256(reinterpret_cast<const __m256i*>(b.lanes));
+    if (Op == VectorOp::Add) x = _mm256_add_epi32(x, y);
+    if (Op == VectorOp::Sub) x = _mm256_sub_epi32(x, y);
+    if (Op == VectorOp::Mul) x = _mm256_mullo_epi32(x, y);
+    if (Op == VectorOp::CmpEq) x = _mm256_and_si256(_mm256_cmpeq_epi32(x, y), _mm256_set1_epi32(1));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(a.lanes), x);
+#elif defined(VM_VECTOR_SSE4)
+    for (int half = 0; half < vectorLanes; half += 4) {
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(a.lanes + half));
+        __m128i y = _mm_load_si128(reinterpret_cast<const __m128i*>(b.lanes + half));
+        if (Op == VectorOp::Add) x = _mm_add_epi32(x, y);
+        if (Op == VectorOp::Sub) x = _mm_sub_epi32(x, y);
+        if (Op == VectorOp::Mul) x = _mm_mullo_epi32(x, y);
+        if (Op == VectorOp::CmpEq) x = _mm_and_si128(_mm_cmpeq_epi32(x, y), _mm_set1_epi32(1));
+        _mm_store_si128(reinterpret_cast<__m128i*>(a.lanes + half), x);
+    }
+#elif defined(VM_VECTOR_NEON)
+    for (int half = 0; half < vectorLanes; half += 4) {
+        int32x4_t x = vld1q_s32(a.lanes + half);
+        int32x4_t y = vld1q_s32(b.lanes + half);
+        if (Op == VectorOp::Add) x = vaddq_s32(x, y);
+        if (Op == VectorOp::Sub) x = vsubq_s32(x, y);
+        if (Op == VectorOp::Mul) x = vmulq_s32(x, y);
+        if (Op == VectorOp::CmpEq) x = vreinterpretq_s32_u32(vandq_u32(vceqq_s32(x, y), vdupq_n_u32(1)));
+        vst1q_s32(a.lanes + half, x);
+    }
+#else
+    // Unsigned arithmetic so overflow wraps like the SIMD paths
+    for (int i = 0; i < vectorLanes; ++i) {
+        uint32_t x = static_cast<uint32_t>(a.lanes[i]);
+        uint32_t y = static_cast<uint32_t>(b.lanes[i]);
+        if (Op == VectorOp::Add) x += y;
+        if (Op == VectorOp::Sub) x -= y;
+        if (Op == VectorOp::Mul) x *= y;
+        if (Op == VectorOp::CmpEq) x = x == y ? 1 : 0;
+        a.lanes[i] = static_cast<int32_t>(x);
+    }
+#endif
+}
+
+// Checked 64-bit arithmetic: out receives the wrapped result and the return
+// value says whether the exact one did not fit
+inline bool addOverflow(int64_t a, int64_t b, int64_t& out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_add_overflow(a, b, &out);
+#else
+    out = static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+    return (a < 0) == (b < 0) && (out < 0) != (a < 0);
+#endif
+}
+
+inline bool subOverflow(int64_t a, int64_t b, int64_t& out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_sub_overflow(a, b, &out);
+#else
+    out = static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+    return (a < 0) != (b < 0) && (out < 0) != (a < 0);
+#endif
+}
+
+inline bool mulOverflow(int64_t a, int64_t b, int64_t& out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_mul_overflow(a, b, &out);
+#else
+    out = static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+    return a != 0 && ((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN) || out / a != b);
+#endif
+}
+
+// Exponentiation by squaring in wrapping 64-bit arithmetic. overflow is set
+// when the exact result does not fit in int64. A negative exponent truncates
+// towards zero the way the integer result of pow() does.
+inline int64_t integerPower(int64_t base, int64_t exponent, bool& overflow) {
+    overflow = false;
+    if (exponent < 0) {
+        if (base == 1) return 1;
+        if (base == -1) return (exponent & 1) ? -1 : 1;
+        return 0;
+    }
+    int64_t result = 1;
+    for (uint64_t e = static_cast<uint64_t>(exponent); e != 0;) {
+        if (e & 1) {
+            overflow |= mulOverflow(result, base, result);
+        }
+        e >>= 1;
+        if (e != 0) {
+            overflow |= mulOverflow(base, base, base);  // Only reported if a later bit uses it
+        }
+    }
+    return result;
+}
+
+// a * b mod m without overflowing for any m up to INT64_MAX
+inline uint64_t multiplyModulo(uint64_t a, uint64_t b, uint64_t m) {
+#if defined(__SIZEOF_INT128__)
+    return static_cast<uint64_t>(static_cast<unsigned __int128>(a) * b % m);
+#else
+    uint64_t result = 0;
+    for (a %= m; b != 0; b >>= 1) {
+        if (b & 1) result = (result + a) % m;
+        a = (a + a) % m;
+    }
+    return result;
+#endif
+}
+
+// base^exponent mod modulus for modulus > 0 and exponent >= 0, result in [0, modulus)
+inline int64_t modularPower(int64_t base, int64_t exponent, int64_t modulus) {
+    uint64_t m = static_cast<uint64_t>(modulus);
+    int64_t reduced = base % modulus;
+    uint64_t b = static_cast<uint64_t>(reduced < 0 ? reduced + modulus : reduced);
+    uint64_t result = 1 % m;
+    for (uint64_t e = static_cast<uint64_t>(exponent); e != 0; e >>= 1) {
+        if (e & 1) result = multiplyModulo(result, b, m);
+        b = multiplyModulo(b, b, m);
+    }
+    return static_cast<int64_t>(result);
+}
+
+// What scalar ADD, SUB, MUL, DIV, EXP and MULADD (and the fused ADDJEQ and
+// SUBJEQ) do when the result does not fit in a register. Vector lanes
+// always wrap.
+enum class OverflowMode {
+    Wrap,  // Keep the low 64 bits
+    Trap   // Stop with an overflow error
+};
+
+// Why a run stopped early. The dispatch loop records a trap and returns
+// instead of throwing; the faulting instruction has not modified any state.
+enum class Trap : uint8_t {
+    None,
+    DivisionByZero,
+    ModulusByZero,
+    InvalidAddress,
+    InvalidRange,
+    OutOfMemory,
+    CallStackOverflow,
+    EmptyCallStack,
+    IntegerOverflow,
+    InvalidModulus,
+    NegativeExponent
+};
+
+inline const char* trapMessage(Trap trap) {
+    switch (trap) {
+        case Trap::None: return "No error";
+        case Trap::DivisionByZero: return "Division by zero!";
+        case Trap::ModulusByZero: return "Modulus by zero!";
+        case Trap::InvalidAddress: return "Invalid memory address!";
+        case Trap::InvalidRange: return "Invalid memory range!";
+        case Trap::OutOfMemory: return "Out of memory!";
+        case Trap::CallStackOverflow: return "Call stack overflow!";
+        case Trap::EmptyCallStack: return "Return from empty call stack!";
+        case Trap::IntegerOverflow: return "Integer overflow!";
+        case Trap::InvalidModulus: return "MODEXP modulus must be positive!";
+        case Trap::NegativeExponent: return "Negative exponent in MODEXP!";
+    }
+    return "Unknown trap";
+}
+
+// Thrown by VirtualMachine::runOrThrow() when a run traps
+class TrapError : public std::runtime_error {
+public:
+    TrapError(Trap kind, int faultPc)
+        : std::runtime_error(std::string(trapMessage(kind)) + " at instruction " + std::to_string(faultPc)),
+          trap(kind), pc(faultPc) {}
+
+    Trap trap;  // What went wrong
+    int pc;     // Index of the faulting instruction
+};
+
+// Decoded operation codes
+enum class OpCode : uint8_t {
+    MOV, ADD, SUB, MUL, DIV, MOD, EXP,
+    GT, LT, EQ,
+    PRINT, JMP, JEQ, CALL, RET,
+    ALLOC, STORE, LOAD, STOREX, LOADX, MEMCPY, MEMSET,
+    VADD, VSUB, VMUL, VCMP, VLOAD, VSTORE,
+    MULADD, MODEXP,
+    ADDJEQ, SUBJEQ, GTJEQ, LTJEQ, EQJEQ,  // Superinstructions made by Program::optimize()
+    MOVC,  // MOV of a constant-pool entry, for values that do not fit in imm
+    NOP
+};
+
+constexpr size_t opcodeKinds = static_cast<size_t>(OpCode::NOP) + 1;
+
+// Mnemonic of an opcode, for diagnostics and profiles
+inline const char* opcodeName(OpCode op) {
+    static const char* const names[opcodeKinds] = {
+        "MOV", "ADD", "SUB", "MUL", "DIV", "MOD", "EXP",
+        "GT", "LT", "EQ",
+        "PRINT", "JMP", "JEQ", "CALL", "RET",
+        "ALLOC", "STORE", "LOAD", "STOREX", "LOADX", "MEMCPY", "MEMSET",
+        "VADD", "VSUB", "VMUL", "VCMP", "VLOAD", "VSTORE",
+        "MULADD", "MODEXP",
+        "ADDJEQ", "SUBJEQ", "GTJEQ", "LTJEQ", "EQJEQ",
+        "MOVC",
+        "NOP"
+    };
+    return static_cast<size_t>(op) < opcodeKinds ? names[static_cast<size_t>(op)] : "?";
+}
+
+// Opcodes whose imm is an instruction index
+inline bool isBranch(OpCode op) {
+    switch (op) {
+        case OpCode::JMP: case OpCode::JEQ: case OpCode::CALL:
+        case OpCode::ADDJEQ: case OpCode::SUBJEQ: case OpCode::GTJEQ: case OpCode::LTJEQ:
+        case OpCode::EQJEQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Packed instruction produced by Program::load(). The same record is
+// stored verbatim in bytecode files, so its layout must not change without
+// bumping BytecodeHeader::version.
+struct Instruction {
+    OpCode op;      // Operation
+    uint8_t r1;     // First register operand
+    uint8_t r2;     // Second register operand
+    uint8_t r3;     // Third register operand
+    int32_t imm;    // Immediate value, address, size, constant index or resolved jump target
+};
+static_assert(sizeof(Instruction) == 8 && std::is_trivially_copyable<Instruction>::value,
+              "Instruction is a fixed-width file record");
+
+// Binary bytecode file layout (native byte order, every section 8-byte aligned):
+//   header | string pool | constant pool | instruction records | symbol table
+// The string pool holds the NUL-terminated label names referenced by the
+// symbol table; the constant pool holds the int64 operands of MOVC.
+struct BytecodeHeader {
+    char magic[4];              // "VMBC"
+    uint16_t version;           // Format version
+    uint16_t recordSize;        // sizeof(Instruction)
+    uint32_t stringOffset;      // Byte offset of the string pool
+    uint32_t stringSize;        // Size of the string pool in bytes
+    uint32_t constantOffset;    // Byte offset of the constant pool
+    uint32_t constantCount;     // Number of int64 constants
+    uint32_t instructionOffset; // Byte offset of the instruction records
+    uint32_t instructionCount;  // Number of instruction records
+    uint32_t symbolOffset;      // Byte offset of the symbol table
+    uint32_t symbolCount;       // Number of symbol table entries
+};
+
+struct BytecodeSymbol {
+    uint32_t name;     // Offset of the label name in the string pool
+    uint32_t address;  // Instruction index the label points at
+};
+
+constexpr char bytecodeMagic[4] = {'V', 'M', 'B', 'C'};
+constexpr uint16_t bytecodeVersion = 7;  // 7: 64-bit registers, constant pool, CALL windows as Rlo..Rhi
+
+// Read-only memory mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    void open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map empty or unreadable file " + path);
+        }
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping keeps the file alive
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Cannot map " + path);
+        }
+        base = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+    }
+
+    void close() {
+        if (base) {
+            munmap(const_cast<char*>(base), length);
+            base = nullptr;
+            length = 0;
+        }
+    }
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const char* base = nullptr;
+    size_t length = 0;
+};
+
+// Immutable, assembled bytecode. A Program is built once and can be shared
+// read-only by any number of VirtualMachine contexts on any thread.
+class Program {
+public:
+    Program() = default;
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    // Assemble bytecode into the instruction array. The first pass records
+    // "label:" lines and drops them from the stream, the second patches every
+    // JMP/JEQ/CALL with the index of its target.
+    void load(const std::vector<std::string>& bytecode) {
+        image.close();
+        code.clear();
+        code.reserve(bytecode.size());
+        literals.clear();
+        labels.clear();
+
+        std::vector<std::pair<size_t, std::string>> fixups;  // Jumps awaiting a target
+        for (const std::string& line : bytecode) {
+            std::string label;
+            if (isLabel(line, label)) {
+                if (!labels.emplace(label, static_cast<int>(code.size())).second) {
+                    throw std::invalid_argument("Duplicate label: " + label);
+                }
+                continue;
+            }
+            std::string target;
+            code.push_back(decode(line, target));
+            if (!target.empty()) {
+                fixups.emplace_back(code.size() - 1, target);
+            }
+        }
+
+        for (const auto& fixup : fixups) {
+            auto it = labels.find(fixup.second);
+            if (it == labels.end()) {
+                throw std::invalid_argument("Error: Undefined label " + fixup.second);
+            }
+            code[fixup.first].imm = it->second;
+        }
+        program = code.data();
+        programSize = static_cast<int>(code.size());
+        constants = literals.data();
+        constantCount = literals.size();
+    }
+
+    // Map a binary bytecode file and execute its instruction records in
+    // place. Only the header, the record operands and the symbol table are
+    // validated; nothing is parsed or copied.
+    void loadBinary(const std::string& path) {
+        code.clear();
+        literals.clear();
+        labels.clear();
+        program = nullptr;
+        programSize = 0;
+        constants = nullptr;
+        constantCount = 0;
+        image.open(path);
+
+        const char* base = image.data();
+        const size_t size = image.size();
+        auto corrupt = [&](const std::string& why) {
+            image.close();
+            throw std::invalid_argument("Invalid bytecode file " + path + ": " + why);
+        };
+        auto inBounds = [&](uint64_t offset, uint64_t bytes) {
+            return offset % 8 == 0 && offset + bytes <= size;
+        };
+
+        if (size < sizeof(BytecodeHeader)) corrupt("truncated header");
+        BytecodeHeader header;
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, bytecodeMagic, sizeof(bytecodeMagic)) != 0) corrupt("bad magic");
+        if (header.version != bytecodeVersion) corrupt("unsupported version");
+        if (header.recordSize != sizeof(Instruction)) corrupt("unexpected record size");
+        if (!inBounds(header.stringOffset, header.stringSize) ||
+            !inBounds(header.constantOffset, uint64_t(header.constantCount) * sizeof(int64_t)) ||
+            !inBounds(header.instructionOffset, uint64_t(header.instructionCount) * sizeof(Instruction)) ||
+            !inBounds(header.symbolOffset, uint64_t(header.symbolCount) * sizeof(BytecodeSymbol))) {
+            corrupt("section out of bounds");
+        }
+        if (header.stringSize > 0 && base[header.stringOffset + header.stringSize - 1] != '\0') {
+            corrupt("unterminated string pool");
+        }
+
+        const Instruction* records = reinterpret_cast<const Instruction*>(base + header.instructionOffset);
+        for (uint32_t i = 0; i < header.instructionCount; ++i) {
+            if (!validRecord(records[i], header.instructionCount, header.constantCount)) {
+                corrupt("bad instruction record " + std::to_string(i));
+            }
+        }
+
+        const BytecodeSymbol* symbols = reinterpret_cast<const BytecodeSymbol*>(base + header.symbolOffset);
+        for (uint32_t i = 0; i < header.symbolCount; ++i) {
+            if (symbols[i].name >= header.stringSize || symbols[i].address > header.instructionCount) {
+                corrupt("bad symbol " + std::to_string(i));
+            }
+            labels[base + header.stringOffset + symbols[i].name] = static_cast<int>(symbols[i].address);
+        }
+
+        program = records;
+        programSize = static_cast<int>(header.instructionCount);
+        constants = reinterpret_cast<const int64_t*>(base + header.constantOffset);
+        constantCount = header.constantCount;
+    }
+
+    // Write the loaded program as a binary bytecode file
+    void save(const std::string& path) const {
+        std::string strings;
+        std::vector<BytecodeSymbol> symbols;
+        symbols.reserve(labels.size());
+        for (const auto& label : labels) {
+            symbols.push_back({static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(label.second)});
+            strings += label.first;
+            strings += '\0';
+        }
+        auto align = [](size_t offset) { return (offset + 7) & ~size_t(7); };
+
+        BytecodeHeader header = {};
+        std::memcpy(header.magic, bytecodeMagic, sizeof(bytecodeMagic));
+        header.version = bytecodeVersion;
+        header.recordSize = sizeof(Instruction);
+        header.stringOffset = sizeof(BytecodeHeader);
+        header.stringSize = static_cast<uint32_t>(strings.size());
+        header.constantOffset = static_cast<uint32_t>(align(header.stringOffset + strings.size()));
+        header.constantCount = static_cast<uint32_t>(constantCount);
+        header.instructionOffset = static_cast<uint32_t>(header.constantOffset + constantCount * sizeof(int64_t));
+        header.instructionCount = static_cast<uint32_t>(programSize);
+        header.symbolOffset = static_cast<uint32_t>(header.instructionOffset + programSize * sizeof(Instruction));
+        header.symbolCount = static_cast<uint32_t>(symbols.size());
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write " + path);
+        }
+        const char padding[8] = {};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(strings.data(), strings.size());
+        out.write(padding, header.constantOffset - header.stringOffset - strings.size());
+        out.write(reinterpret_cast<const char*>(constants), constantCount * sizeof(int64_t));
+        out.write(reinterpret_cast<const char*>(program), programSize * sizeof(Instruction));
+        out.write(reinterpret_cast<const char*>(symbols.data()), symbols.size() * sizeof(BytecodeSymbol));
+        if (!out) {
+            throw std::runtime_error("Failed writing " + path);
+        }
+    }
+
+    // Peephole-optimise the program in place: constant folding, jump
+    // threading, removal of jumps to the next instruction and of
+    // unreachable code, dead MOV elimination, and fusion of an ALU/compare
+    // instruction with a following JEQ into one superinstruction. Output,
+    // traps and the registers and heap at the end or at a trap are
+    // unchanged; instruction count and the pc of a trap may differ. Call it
+    // after load() and before sharing the program.
+    void optimize() {
+        if (!image.data() && code.empty()) {
+            return;
+        }
+        if (image.data()) {
+            code.assign(program, program + programSize);  // Work on a private copy
+            literals.assign(constants, constants + constantCount);
+            image.close();
+        }
+
+        for (int pass = 0; pass < 8; ++pass) {
+            bool changed = threadJumps();
+            changed |= foldConstants();
+            changed |= removeRedundant();
+            if (!changed) {
+                break;
+            }
+        }
+        fuseBranches();
+
+        program = code.data();
+        programSize = static_cast<int>(code.size());
+        constants = literals.data();
+        constantCount = literals.size();
+    }
+
+    const Instruction* instructions() const { return program; }
+    int size() const { return programSize; }
+    const int64_t* constantPool() const { return constants; }
+    const std::unordered_map<std::string, int>& symbols() const { return labels; }
+
+private:
+    std::vector<Instruction> code;  // Instructions assembled from text
+    std::vector<int64_t> literals;  // Constant pool assembled from text
+    MappedFile image;  // Mapped bytecode file, if loaded from binary
+    const Instruction* program = nullptr;  // Instructions being executed
+    int programSize = 0;  // Number of instructions being executed
+    const int64_t* constants = nullptr;  // MOVC operands of the executing program
+    size_t constantCount = 0;  // Entries in the constant pool
+    std::unordered_map<std::string, int> labels;  // Label addresses
+
+    // Instruction indices control can enter other than by falling through
+    std::vector<bool> branchTargets() const {
+        std::vector<bool> target(code.size() + 1, false);
+        target[0] = true;
+        for (const Instruction& instruction : code) {
+            if (isBranch(instruction.op)) {
+                target[instruction.imm] = true;
+            }
+            if (instruction.op == OpCode::CALL) {
+                // The return lands after the CALL
+                target[&instruction - code.data() + 1] = true;
+            }
+        }
+        for (const auto& label : labels) {
+            target[label.second] = true;
+        }
+        return target;
+    }
+
+    // Whether instruction reads scalar register reg
+    static bool readsRegister(const Instruction& instruction, int reg) {
+        switch (instruction.op) {
+            case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+            case OpCode::MOD: case OpCode::EXP: case OpCode::GT: case OpCode::LT:
+            case OpCode::EQ: case OpCode::JEQ: case OpCode::STOREX:
+                return instruction.r1 == reg || instruction.r2 == reg;
+            case OpCode::PRINT: case OpCode::STORE:
+                return instruction.r1 == reg;
+            case OpCode::LOADX: case OpCode::VLOAD: case OpCode::VSTORE:
+                return instruction.r2 == reg;
+            case OpCode::MEMCPY: case OpCode::MEMSET: case OpCode::MULADD: case OpCode::MODEXP:
+            case OpCode::ADDJEQ: case OpCode::SUBJEQ: case OpCode::GTJEQ: case OpCode::LTJEQ:
+            case OpCode::EQJEQ:
+                return instruction.r1 == reg || instruction.r2 == reg || instruction.r3 == reg;
+            case OpCode::CALL: case OpCode::RET:
+                return true;  // The other side of the call may read anything
+            default:
+                return false;
+        }
+    }
+
+    // Whether instruction overwrites scalar register reg
+    static bool writesRegister(const Instruction& instruction, int reg) {
+        switch (instruction.op) {
+            case OpCode::MOV: case OpCode::ADD: case OpCode::SUB: case OpCode::MUL:
+            case OpCode::DIV: case OpCode::MOD: case OpCode::EXP: case OpCode::GT:
+            case OpCode::LT: case OpCode::EQ: case OpCode::ALLOC: case OpCode::LOAD:
+            case OpCode::LOADX: case OpCode::MULADD: case OpCode::MODEXP:
+            case OpCode::ADDJEQ: case OpCode::SUBJEQ: case OpCode::GTJEQ: case OpCode::LTJEQ:
+            case OpCode::EQJEQ: case OpCode::MOVC:
+                return instruction.r1 == reg;
+            case OpCode::CALL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Instructions that can stop the run with a trap, leaving the registers
+    // as they are for the caller to inspect
+    static bool mayTrap(OpCode op) {
+        switch (op) {
+            case OpCode::DIV: case OpCode::MOD: case OpCode::EXP: case OpCode::CALL:
+            case OpCode::RET: case OpCode::ALLOC: case OpCode::STORE: case OpCode::LOAD:
+            case OpCode::STOREX: case OpCode::LOADX: case OpCode::MEMCPY: case OpCode::MEMSET:
+            case OpCode::VLOAD: case OpCode::VSTORE: case OpCode::MULADD: case OpCode::MODEXP:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Instructions after which control does not fall through to the next one
+    static bool endsFlow(OpCode op) {
+        return op == OpCode::JMP || op == OpCode::RET;
+    }
+
+    // Fold op applied to two known register values. Returns false when the
+    // result is not a plain value (division by zero, overflow, ...), leaving
+    // the runtime to produce the same outcome it always would.
+    static bool evaluate(OpCode op, int64_t a, int64_t b, int64_t& result) {
+        switch (op) {
+            case OpCode::ADD: return !addOverflow(a, b, result);
+            case OpCode::SUB: return !subOverflow(a, b, result);
+            case OpCode::MUL: return !mulOverflow(a, b, result);
+            case OpCode::DIV:
+                if (b == 0 || (a == INT64_MIN && b == -1)) return false;
+                result = a / b;
+                return true;
+            case OpCode::MOD:
+                if (b == 0) return false;
+                result = b == -1 ? 0 : a % b;  // INT64_MIN % -1 is 0, but faults in hardware
+                return true;
+            case OpCode::EXP: {
+                bool overflow;
+                result = integerPower(a, b, overflow);
+                return !overflow;
+            }
+            case OpCode::GT: result = a > b; return true;
+            case OpCode::LT: result = a < b; return true;
+            case OpCode::EQ: result = a == b; return true;
+            default: return false;
+        }
+    }
+
+    // MOV of value as an immediate when it fits, otherwise MOVC of a
+    // (shared) constant-pool entry
+    Instruction loadConstant(uint8_t reg, int64_t value) {
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+            return {OpCode::MOV, reg, 0, 0, static_cast<int32_t>(value)};
+        }
+        auto found = std::find(literals.begin(), literals.end(), value);
+        if (found == literals.end()) {
+            if (literals.size() == static_cast<size_t>(INT32_MAX)) {
+                throw std::length_error("Constant pool is full");
+            }
+            found = literals.insert(literals.end(), value);
+        }
+        return {OpCode::MOVC, reg, 0, 0, static_cast<int32_t>(found - literals.begin())};
+    }
+
+    // Point jumps that land on an unconditional JMP straight at its target
+    bool threadJumps() {
+        bool changed = false;
+        for (Instruction& instruction : code) {
+            if (!isBranch(instruction.op)) {
+                continue;
+            }
+            int target = instruction.imm;
+            for (size_t hops = 0; hops < code.size(); ++hops) {
+                if (target >= static_cast<int>(code.size()) || code[target].op != OpCode::JMP ||
+                    code[target].imm == target) {
+                    break;
+                }
+                target = code[target].imm;
+            }
+            if (target != instruction.imm) {
+                instruction.imm = target;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // Track registers holding known constants through each basic block and
+    // rewrite ALU ops on them as MOV, and JEQ on them as JMP or NOP
+    bool foldConstants() {
+        const std::vector<bool> target = branchTargets();
+        bool known[registerCount] = {};
+        int64_t value[registerCount] = {};
+        bool changed = false;
+
+        for (size_t i = 0; i < code.size(); ++i) {
+            Instruction& instruction = code[i];
+            if (target[i]) {
+                std::fill(std::begin(known), std::end(known), false);
+            }
+            int64_t result;
+            switch (instruction.op) {
+                case OpCode::MOV:
+                    known[instruction.r1] = true;
+                    value[instruction.r1] = instruction.imm;
+                    continue;
+                case OpCode::MOVC:
+                    known[instruction.r1] = true;
+                    value[instruction.r1] = literals[instruction.imm];
+                    continue;
+                case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+                case OpCode::MOD: case OpCode::EXP: case OpCode::GT: case OpCode::LT:
+                case OpCode::EQ:
+                    if (known[instruction.r1] && known[instruction.r2] &&
+                        evaluate(instruction.op, value[instruction.r1], value[instruction.r2], result)) {
+                        instruction = loadConstant(instruction.r1, result);
+                        value[instruction.r1] = result;
+                        changed = true;
+                        continue;
+                    }
+                    break;
+                case OpCode::JEQ:
+                    if (known[instruction.r1] && known[instruction.r2]) {
+                        bool taken = value[instruction.r1] == value[instruction.r2];
+                        instruction = {taken ? OpCode::JMP : OpCode::NOP, 0, 0, 0, taken ? instruction.imm : 0};
+                        changed = true;
+                    }
+                    continue;
+                default:
+                    break;
+            }
+            // Only CALL writes anything other than r1
+            if (instruction.op == OpCode::CALL) {
+                std::fill(std::begin(known), std::end(known), false);
+            } else if (writesRegister(instruction, instruction.r1)) {
+                known[instruction.r1] = false;
+            }
+        }
+        return changed;
+    }
+
+    // Drop NOPs, jumps to the next instruction, MOVs whose value is
+    // overwritten before use, and code no path can reach. A LOAD straight
+    // after a STORE of the same register stays: cells are 32 bits, so it
+    // truncates the register.
+    bool removeRedundant() {
+        const size_t count = code.size();
+        const std::vector<bool> target = branchTargets();
+        std::vector<bool> remove(count, false);
+
+        for (size_t i = 0; i < count; ++i) {
+            const Instruction& instruction = code[i];
+            if (instruction.op == OpCode::NOP ||
+                (instruction.op == OpCode::JMP && instruction.imm == static_cast<int>(i + 1))) {
+                remove[i] = true;
+            } else if ((instruction.op == OpCode::MOV || instruction.op == OpCode::MOVC) &&
+                       overwrittenBeforeUse(i, target)) {
+                remove[i] = true;
+            }
+        }
+
+        // Reachability from the entry point and every labelled address
+        std::vector<bool> reachable(count + 1, false);
+        std::vector<size_t> work = {0};
+        for (const auto& label : labels) {
+            work.push_back(label.second);
+        }
+        while (!work.empty()) {
+            size_t i = work.back();
+            work.pop_back();
+            while (i < count && !reachable[i]) {
+                reachable[i] = true;
+                const Instruction& instruction = code[i];
+                if (isBranch(instruction.op)) {
+                    work.push_back(instruction.imm);
+                }
+                if (endsFlow(instruction.op)) {
+                    break;
+                }
+                ++i;
+            }
+        }
+
+        bool changed = false;
+        for (size_t i = 0; i < count; ++i) {
+            if (!reachable[i]) {
+                remove[i] = true;
+            }
+            changed |= remove[i];
+        }
+        if (changed) {
+            compact(remove);
+        }
+        return changed;
+    }
+
+    // Whether the register set by the MOV at index is rewritten before any
+    // read, looking only at the straight-line code that follows it. A trap
+    // in between would leave the value visible.
+    bool overwrittenBeforeUse(size_t index, const std::vector<bool>& target) const {
+        const int reg = code[index].r1;
+        for (size_t i = index + 1; i < code.size() && !target[i]; ++i) {
+            const Instruction& next = code[i];
+            if (readsRegister(next, reg)) {
+                return false;
+            }
+            if (writesRegister(next, reg)) {
+                return !mayTrap(next.op);
+            }
+            if (isBranch(next.op) || endsFlow(next.op) || mayTrap(next.op)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Merge ADD/SUB/GT/LT/EQ Ra Rb with a following JEQ on Ra into one
+    // superinstruction: Ra = Ra <op> Rb; if Ra == Rc jump
+    void fuseBranches() {
+        const std::vector<bool> target = branchTargets();
+        std::vector<bool> remove(code.size(), false);
+        static const std::unordered_map<int, OpCode> fused = {
+            {int(OpCode::ADD), OpCode::ADDJEQ}, {int(OpCode::SUB), OpCode::SUBJEQ},
+            {int(OpCode::GT), OpCode::GTJEQ}, {int(OpCode::LT), OpCode::LTJEQ},
+            {int(OpCode::EQ), OpCode::EQJEQ}
+        };
+
+        for (size_t i = 0; i + 1 < code.size(); ++i) {
+            Instruction& first = code[i];
+            const Instruction& branch = code[i + 1];
+            auto it = fused.find(int(first.op));
+            if (it == fused.end() || branch.op != OpCode::JEQ || target[i + 1] || remove[i]) {
+                continue;
+            }
+            int other;
+            if (branch.r1 == first.r1) {
+                other = branch.r2;
+            } else if (branch.r2 == first.r1) {
+                other = branch.r1;
+            } else {
+                continue;
+            }
+            first = {it->second, first.r1, first.r2, static_cast<uint8_t>(other), branch.imm};
+            remove[i + 1] = true;
+        }
+        compact(remove);
+    }
+
+    // Delete the marked instructions and renumber every jump and label. A
+    // target that pointed at a removed instruction moves to the next kept one.
+    void compact(const std::vector<bool>& remove) {
+        std::vector<int32_t> renumber(code.size() + 1);
+        int32_t kept = 0;
+        for (size_t i = 0; i < code.size(); ++i) {
+            renumber[i] = kept;
+            if (!remove[i]) {
+                ++kept;
+            }
+        }
+        renumber[code.size()] = kept;
+
+        size_t out = 0;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (remove[i]) {
+                continue;
+            }
+            Instruction instruction = code[i];
+            if (isBranch(instruction.op)) {
+                instruction.imm = renumber[instruction.imm];
+            }
+            code[out++] = instruction;
+        }
+        code.resize(out);
+        for (auto& label : labels) {
+            label.second = renumber[label.second];
+        }
+    }
+
+    // Check that a record read from a file is safe to execute
+    static bool validRecord(const Instruction& instruction, uint32_t count, uint32_t constantCount) {
+        int limit1 = registerCount, limit2 = registerCount, limit3 = registerCount;  // Register file each operand indexes
+        switch (instruction.op) {
+            case OpCode::VADD:
+            case OpCode::VSUB:
+            case OpCode::VMUL:
+            case OpCode::VCMP:
+                limit1 = limit2 = vectorRegisterCount;
+                break;
+            case OpCode::VLOAD:
+            case OpCode::VSTORE:
+                limit1 = vectorRegisterCount;
+                break;
+            case OpCode::CALL:
+                limit3 = 2;  // Window flag
+                if (instruction.r3 != 0 && instruction.r2 < instruction.r1) {
+                    return false;
+                }
+                break;
+            case OpCode::MOVC:
+                if (instruction.imm < 0 || static_cast<uint32_t>(instruction.imm) >= constantCount) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+        if (instruction.op > OpCode::NOP || instruction.r1 >= limit1 || instruction.r2 >= limit2 || instruction.r3 >= limit3) {
+            return false;
+        }
+        if (isBranch(instruction.op)) {
+            return instruction.imm >= 0 && static_cast<uint32_t>(instruction.imm) <= count;
+        }
+        return true;
+    }
+
+    // Recognise a "name:" line and extract the label name
+    static bool isLabel(const std::string& line, std::string& label) {
+        std::istringstream in(line);
+        std::string token, rest;
+        if (!(in >> token) || token.size() < 2 || token.back() != ':' || (in >> rest)) {
+            return false;
+        }
+        label = token.substr(0, token.size() - 1);
+        return true;
+    }
+
+    // Translate one line of text bytecode into its packed form. For jumps the
+    // label name is returned through target and patched later by load().
+    Instruction decode(const std::string& line, std::string& target) {
+        std::istringstream in(line);
+        std::string op;
+        std::vector<std::string> operands;
+        in >> op;
+        for (std::string operand; in >> operand;) {
+            operands.push_back(operand);
+        }
+
+        Instruction instruction = {OpCode::NOP, 0, 0, 0, 0};
+        auto expect = [&](size_t count) {
+            if (operands.size() != count) {
+                throw std::invalid_argument("Malformed instruction: " + line);
+            }
+        };
+
+        static const std::unordered_map<std::string, OpCode> binary = {
+            {"ADD", OpCode::ADD}, {"SUB", OpCode::SUB}, {"MUL", OpCode::MUL},
+            {"DIV", OpCode::DIV}, {"MOD", OpCode::MOD}, {"EXP", OpCode::EXP},
+            {"GT", OpCode::GT}, {"LT", OpCode::LT}, {"EQ", OpCode::EQ}
+        };
+        static const std::unordered_map<std::string, OpCode> vector = {
+            {"VADD", OpCode::VADD}, {"VSUB", OpCode::VSUB},
+            {"VMUL", OpCode::VMUL}, {"VCMP", OpCode::VCMP}
+        };
+
+        if (op.empty()) {
+            // Blank line
+        } else if (op == "MOV") {
+            // Values outside the int32 immediate go through the constant pool
+            expect(2);
+            instruction = loadConstant(parseRegister(operands[0], line), parseLiteral(operands[1], line));
+        } else if (binary.count(op)) {
+            expect(2);
+            instruction.op = binary.at(op);
+            instruction.r1 = parseRegister(operands[0], line);
+            instruction.r2 = parseRegister(operands[1], line);
+        } else if (op == "MULADD" || op == "MODEXP") {
+            // MULADD Ra Rb Rc: Ra += Rb * Rc / MODEXP Ra Rb Rc: Ra = Ra^Rb mod Rc
+            expect(3);
+            instruction.op = op == "MULADD" ? OpCode::MULADD : OpCode::MODEXP;
+            instruction.r1 = parseRegister(operands[0], line);
+            instruction.r2 = parseRegister(operands[1], line);
+            instruction.r3 = parseRegister(operands[2], line);
+        } else if (op == "PRINT") {
+            expect(1);
+            instruction.op = OpCode::PRINT;
+            instruction.r1 = parseRegister(operands[0], line);
+        } else if (op == "JMP") {
+            expect(1);
+            instruction.op = OpCode::JMP;
+            target = operands[0];
+        } else if (op == "CALL") {
+            // CALL label [Rlo Rhi]: optionally save registers Rlo..Rhi in the
+            // frame, restored by the matching RET. r1 and r2 are the first and
+            // last saved register and r3 is 1 when there is a window.
+            if (operands.size() != 1) {
+                expect(3);
+            }
+            instruction.op = OpCode::CALL;
+            target = operands[0];
+            if (operands.size() == 3) {
+                int first = parseRegister(operands[1], line);
+                int last = parseRegister(operands[2], line);
+                if (last < first) {
+                    throw std::invalid_argument("Empty register window in: " + line);
+                }
+                instruction.r1 = static_cast<uint8_t>(first);
+                instruction.r2 = static_cast<uint8_t>(last);
+                instruction.r3 = 1;
+            }
+        } else if (op == "JEQ") {
+            expect(3);
+            instruction.op = OpCode::JEQ;
+            instruction.r1 = parseRegister(operands[0], line);
+            instruction.r2 = parseRegister(operands[1], line);
+            target = operands[2];
+        } else if (op == "RET") {
+            expect(0);
+            instruction.op = OpCode::RET;
+        } else if (op == "ALLOC") {
+            expect(2);
+            instruction.op = OpCode::ALLOC;
+            instruction.r1 = parseRegister(operands[0], line);
+            instruction.imm = parseImmediate(operands[1], line);
+            if (instruction.imm < 0) {
+                throw std::invalid_argument("Negative allocation size in: " + line);
+            }
+        } else if (op == "STORE" || op == "LOAD") {
+            // Either a literal address or a "[Rn]", "[Rn+k]", "[Rn-k]" operand
+            if (operands.size() > 2 && operands[1][0] == '[') {
+                for (size_t i = 2; i < operands.size(); ++i) {
+                    operands[1] += operands[i];
+                }
+                operands.resize(2);
+            }
+            expect(2);
+            instruction.r1 = parseRegister(operands[0], line);
+            if (operands[1][0] == '[') {
+                instruction.op = op == "STORE" ? OpCode::STOREX : OpCode::LOADX;
+                parseIndirect(operands[1], line, instruction);
+            } else {
+                instruction.op = op == "STORE" ? OpCode::STORE : OpCode::LOAD;
+                instruction.imm = parseImmediate(operands[1], line);
+            }
+        } else if (vector.count(op)) {
+            // VADD/VSUB/VMUL/VCMP Va Vb: Va = Va <op> Vb lane by lane
+            expect(2);
+            instruction.op = vector.at(op);
+            instruction.r1 = parseVectorRegister(operands[0], line);
+            instruction.r2 = parseVectorRegister(operands[1], line);
+        } else if (op == "VLOAD" || op == "VSTORE") {
+            // VLOAD/VSTORE Vn [Rb+k]: move vectorLanes consecutive heap cells
+            if (operands.size() > 2 && operands[1][0] == '[') {
+                for (size_t i = 2; i < operands.size(); ++i) {
+                    operands[1] += operands[i];
+                }
+                operands.resize(2);
+            }
+            expect(2);
+            instruction.op = op == "VLOAD" ? OpCode::VLOAD : OpCode::VSTORE;
+            instruction.r1 = parseVectorRegister(operands[0], line);
+            if (operands[1][0] != '[') {
+                throw std::invalid_argument("Expected [Rn+k] address in: " + line);
+            }
+            parseIndirect(operands[1], line, instruction);
+        } else if (op == "MEMCPY" || op == "MEMSET") {
+            // MEMCPY Rdst Rsrc Rcount / MEMSET Rdst Rvalue Rcount
+            expect(3);
+            instruction.op = op == "MEMCPY" ? OpCode::MEMCPY : OpCode::MEMSET;
+            instruction.r1 = parseRegister(operands[0], line);
+            instruction.r2 = parseRegister(operands[1], line);
+            instruction.r3 = parseRegister(operands[2], line);
+        } else {
+            throw std::invalid_argument("Unknown instruction: " + line);
+        }
+        return instruction;
+    }
+
+    // "R<n>" for any n below registerCount
+    uint8_t parseRegister(const std::string& operand, const std::string& line) {
+        int reg = registerCount;
+        if (operand.size() >= 2 && operand.size() <= 4 && operand[0] == 'R' &&
+            std::all_of(operand.begin() + 1, operand.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            reg = std::stoi(operand.substr(1));
+        }
+        if (reg >= registerCount) {
+            throw std::invalid_argument("Invalid register in: " + line);
+        }
+        return static_cast<uint8_t>(reg);
+    }
+
+    uint8_t parseVectorRegister(const std::string& operand, const std::string& line) {
+        if (operand.size() != 2 || operand[0] != 'V' || operand[1] < '0' || operand[1] >= '0' + vectorRegisterCount) {
+            throw std::invalid_argument("Invalid vector register in: " + line);
+        }
+        return static_cast<uint8_t>(operand[1] - '0');
+    }
+
+    // Decode "[Rn]" or "[Rn+k]" / "[Rn-k]" into base register r2 and offset imm
+    void parseIndirect(const std::string& operand, const std::string& line, Instruction& instruction) {
+        if (operand.size() < 4 || operand.back() != ']') {
+            throw std::invalid_argument("Invalid address in: " + line);
+        }
+        std::string inner = operand.substr(1, operand.size() - 2);
+        size_t sign = inner.find_first_of("+-");
+        instruction.r2 = parseRegister(inner.substr(0, sign), line);
+        if (sign != std::string::npos) {
+            std::string offset = inner.substr(sign + (inner[sign] == '+' ? 1 : 0));
+            instruction.imm = parseImmediate(offset, line);
+        }
+    }
+
+    int32_t parseImmediate(const std::string& operand, const std::string& line) {
+        try {
+            size_t used = 0;
+            int value = std::stoi(operand, &used);
+            if (used == operand.size()) {
+                return value;
+            }
+        } catch (const std::exception&) {
+        }
+        throw std::invalid_argument("Invalid immediate in: " + line);
+    }
+
+    // Full-width MOV operand
+    int64_t parseLiteral(const std::string& operand, const std::string& line) {
+        try {
+            size_t used = 0;
+            long long value = std::stoll(operand, &used);
+            if (used == operand.size()) {
+                return value;
+            }
+        } catch (const std::exception&) {
+        }
+        throw std::invalid_argument("Invalid immediate in: " + line);
+    }
+};
+
+// Opt-in instrumentation. Build with -DVM_PROFILE=1 to record per-opcode
+// counts and cycles, per-pc hits, JEQ outcomes and call depth; without it
+// the hooks in the dispatch loop compile to nothing. Time spent in JIT-compiled
+// regions is charged to the branch that entered them.
+#if !defined(VM_PROFILE)
+#define VM_PROFILE 0
+#endif
+
+#if VM_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t profileClock() { return __rdtsc(); }
+#else
+#include <chrono>
+inline uint64_t profileClock() {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
+#endif
+
+// Counters collected by a profiling build, see VM_PROFILE
+struct Profile {
+    uint64_t opcodeCount[opcodeKinds] = {};   // Executions per opcode
+    uint64_t opcodeCycles[opcodeKinds] = {};  // Clock ticks per opcode
+    std::vector<uint64_t> pcHits;             // Executions per instruction index
+    std::vector<uint64_t> branchTaken;        // JEQ (and fused JEQ) taken, per instruction index
+    std::vector<uint64_t> branchNotTaken;     // JEQ (and fused JEQ) not taken, per instruction index
+    size_t maxCallDepth = 0;                  // Deepest CALL nesting reached
+
+    // Call-stack tree for flame graphs. Node 0 is the entry point; every
+    // other node is a (parent node, callee address) pair.
+    std::vector<std::pair<int, int>> stacks = {{-1, 0}};
+    std::vector<uint64_t> stackCycles = {0};  // Clock ticks spent directly in each node
+
+    // Write everything as one JSON object
+    void writeJson(std::ostream& out, const std::unordered_map<std::string, int>& symbols) const {
+        out << "{\n  \"opcodes\": {";
+        bool first = true;
+        for (size_t op = 0; op < opcodeKinds; ++op) {
+            if (opcodeCount[op] == 0) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    \"" << opcodeName(static_cast<OpCode>(op)) << "\": {\"count\": "
+                << opcodeCount[op] << ", \"cycles\": " << opcodeCycles[op] << "}";
+            first = false;
+        }
+        out << "\n  },\n  \"pcHits\": [";
+        for (size_t i = 0; i < pcHits.size(); ++i) {
+            out << (i ? ", " : "") << pcHits[i];
+        }
+        out << "],\n  \"branches\": [";
+        first = true;
+        for (size_t i = 0; i < branchTaken.size(); ++i) {
+            if (branchTaken[i] == 0 && branchNotTaken[i] == 0) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    {\"pc\": " << i << ", \"taken\": " << branchTaken[i]
+                << ", \"notTaken\": " << branchNotTaken[i] << "}";
+            first = false;
+        }
+        out << (first ? "" : "\n  ") << "],\n  \"maxCallDepth\": " << maxCallDepth << ",\n  \"stacks\": [";
+        for (size_t node = 0; node < stacks.size(); ++node) {
+            out << (node ? ",\n" : "\n") << "    {\"stack\": \"" << stackName(static_cast<int>(node), symbols)
+                << "\", \"cycles\": " << stackCycles[node] << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    // Write folded stacks ("main;f;g cycles" per line) for flamegraph.pl
+    void writeFolded(std::ostream& out, const std::unordered_map<std::string, int>& symbols) const {
+        for (size_t node = 0; node < stacks.size(); ++node) {
+            if (stackCycles[node] != 0) {
+                out << stackName(static_cast<int>(node), symbols) << ' ' << stackCycles[node] << '\n';
+            }
+        }
+    }
+
+private:
+    std::string stackName(int node, const std::unordered_map<std::string, int>& symbols) const {
+        if (node == 0) {
+            return "main";
+        }
+        std::string callee = "pc_" + std::to_string(stacks[node].second);
+        for (const auto& symbol : symbols) {
+            if (symbol.second == stacks[node].second) {
+                callee = symbol.first;
+                break;
+            }
+        }
+        return stackName(stacks[node].first, symbols) + ";" + callee;
+    }
+};
+
+// Buffered destination for PRINT output. Text is collected in a fixed
+// buffer and handed to emit() only when the buffer fills or on flush(), so a
+// run costs a handful of writes instead of one flush per PRINT.
+class OutputSink {
+public:
+    static constexpr size_t defaultCapacity = 64 * 1024;
+
+    explicit OutputSink(size_t capacity = defaultCapacity) : buffer(std::max<size_t>(capacity, 16)) {}
+    virtual ~OutputSink() = default;
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    void write(const char* text, size_t length) {
+        if (length > buffer.size() - used) {
+            flush();
+            if (length >= buffer.size()) {
+                emit(text, length);
+                return;
+            }
+        }
+        std::memcpy(buffer.data() + used, text, length);
+        used += length;
+    }
+
+    void put(char c) {
+        if (used == buffer.size()) {
+            flush();
+        }
+        buffer[used++] = c;
+    }
+
+    // Decimal formatting without iostreams or locales
+    void writeInt(int64_t value) {
+        char digits[20];
+        char* end = digits + sizeof(digits);
+        char* p = end;
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do {
+            *--p = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (value < 0) {
+            put('-');
+        }
+        write(p, end - p);
+    }
+
+    void flush() {
+        if (used != 0) {
+            emit(buffer.data(), used);
+            used = 0;
+        }
+    }
+
+protected:
+    // Deliver buffered bytes to the target
+    virtual void emit(const char* data, size_t length) = 0;
+
+    // Subclasses must call this from their destructor, while emit() still works
+    void finish() {
+        flush();
+    }
+
+private:
+    std::vector<char> buffer;
+    size_t used = 0;
+};
+
+// Writes to a file descriptor (stdout by default) with raw write() calls
+class FileDescriptorSink : public OutputSink {
+public:
+    explicit FileDescriptorSink(int descriptor = STDOUT_FILENO, size_t capacity = defaultCapacity)
+        : OutputSink(capacity), fd(descriptor) {}
+
+    ~FileDescriptorSink() override {
+        finish();
+    }
+
+protected:
+    void emit(const char* data, size_t length) override {
+        while (length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;  // Output is best effort, like std::cout
+            }
+            data += written;
+            length -= static_cast<size_t>(written);
+        }
+    }
+
+    int fd;
+};
+
+// Writes to a file it creates (or truncates)
+class FileSink : public FileDescriptorSink {
+public:
+    explicit FileSink(const std::string& path, size_t capacity = defaultCapacity)
+        : FileDescriptorSink(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644), capacity) {
+        if (fd < 0) {
+            throw std::runtime_error("Cannot write " + path);
+        }
+    }
+
+    ~FileSink() override {
+        finish();
+        ::close(fd);
+    }
+};
+
+// Collects output in memory, e.g. to check what a program printed
+class StringSink : public OutputSink {
+public:
+    using OutputSink::OutputSink;
+
+    ~StringSink() override {
+        finish();
+    }
+
+    // Everything written so far, including still-buffered text
+    const std::string& str() {
+        flush();
+        return text;
+    }
+
+    void clear() {
+        flush();
+        text.clear();
+    }
+
+protected:
+    void emit(const char* data, size_t length) override {
+        text.append(data, length);
+    }
+
+private:
+    std::string text;
+};
+
+// Baseline JIT for x86-64. A region is a run of consecutive supported
+// instructions on R0-R5 starting at a hot branch target; it is compiled once
+// into native code that keeps those in CPU registers, takes branches inside the
+// region directly and returns to the interpreter (with the registers written
+// back) at any other exit. DIV/MOD bail out to the interpreter on a divisor
+// of 0 or -1, where it raises the same trap or gives the same wrapped
+// INT64_MIN / -1 result as it would have without the JIT.
+#if !defined(VM_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define VM_JIT 1
+#else
+#define VM_JIT 0
+#endif
+
+// Entry point of a compiled region: runs on the register file and returns
+// the index of the next instruction for the interpreter
+using JitFunction = int (*)(int64_t* registers);
+
+#if VM_JIT
+// Page-aligned executable copy of generated machine code (W^X: written
+// while mapped read/write, then flipped to read/execute)
+class ExecutableMemory {
+public:
+    explicit ExecutableMemory(const std::vector<uint8_t>& machineCode) {
+        length = machineCode.size();
+        void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Cannot allocate JIT memory");
+        }
+        std::memcpy(mapped, machineCode.data(), length);
+        if (mprotect(mapped, length, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mapped, length);
+            throw std::runtime_error("Cannot make JIT memory executable");
+        }
+        base = mapped;
+    }
+
+    ~ExecutableMemory() {
+        munmap(base, length);
+    }
+
+    ExecutableMemory(const ExecutableMemory&) = delete;
+    ExecutableMemory& operator=(const ExecutableMemory&) = delete;
+
+    JitFunction entry() const { return reinterpret_cast<JitFunction>(base); }
+
+private:
+    void* base;
+    size_t length;
+};
+
+class JitCompiler {
+public:
+    static constexpr int maxRegionLength = 512;  // Instructions per compiled region
+    static constexpr int jitRegisters = 6;  // R0-R5 live in host registers; nothing else is compiled
+
+    // Whether the JIT can translate this instruction
+    static bool supported(const Instruction& instruction) {
+        if (instruction.r1 >= jitRegisters || instruction.r2 >= jitRegisters || instruction.r3 >= jitRegisters) {
+            return false;
+        }
+        switch (instruction.op) {
+            case OpCode::MOV: case OpCode::ADD: case OpCode::SUB: case OpCode::MUL:
+            case OpCode::DIV: case OpCode::MOD: case OpCode::GT: case OpCode::LT:
+            case OpCode::EQ: case OpCode::JMP: case OpCode::JEQ: case OpCode::NOP:
+            case OpCode::ADDJEQ: case OpCode::SUBJEQ: case OpCode::GTJEQ: case OpCode::LTJEQ:
+            case OpCode::EQJEQ:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Compile the region starting at start, or return null when the
+    // instruction there cannot be compiled
+    static std::unique_ptr<ExecutableMemory> compile(const Instruction* code, int size, int start) {
+        int end = start;
+        while (end < size && end - start < maxRegionLength && supported(code[end])) {
+            ++end;
+        }
+        if (end == start) {
+            return nullptr;
+        }
+        JitCompiler compiler(start, end);
+        compiler.emitRegion(code);
+        return std::make_unique<ExecutableMemory>(compiler.bytes);
+    }
+
+private:
+    // x86-64 register numbers
+    enum : int { EAX = 0, ECX = 1, EDX = 2, ESI = 6, EDI = 7, R8 = 8, R9 = 9, R10 = 10, R11 = 11 };
+    // Condition codes for Jcc/SETcc
+    enum : uint8_t { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_G = 0xF };
+
+    // Home of R0-R5 in the generated code. All are caller-saved in the
+    // System V ABI, and EAX/EDX stay free as scratch for IDIV.
+    static constexpr int hostRegister[jitRegisters] = {R8, R9, R10, R11, ESI, ECX};
+
+    struct Patch {
+        size_t at;   // Offset of a rel32 field
+        int target;  // Instruction index it must reach
+    };
+
+    int start, end;
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> offsets;  // Native offset of each instruction in the region
+    std::vector<Patch> internal;  // Jumps to instructions inside the region
+    std::vector<Patch> exits;     // Jumps that leave the region
+
+    JitCompiler(int first, int last) : start(first), end(last), offsets(last - first) {}
+
+    void emit(uint8_t byte) { bytes.push_back(byte); }
+
+    void emit32(int32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            emit(static_cast<uint8_t>(static_cast<uint32_t>(value) >> (8 * i)));
+        }
+    }
+
+    // REX prefix; wide selects 64-bit operand size
+    void rex(int reg, int rm, bool wide = true) {
+        uint8_t prefix = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+        if (prefix != 0x40) emit(prefix);
+    }
+
+    // <opcode> r/m64, r64 in register-direct form: ADD 01, SUB 29, CMP 39, MOV 89, TEST 85
+    void aluRR(uint8_t opcode, int dst, int src) {
+        rex(src, dst);
+        emit(opcode);
+        emit(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    void imulRR(int dst, int src) {
+        rex(dst, src);
+        emit(0x0F);
+        emit(0xAF);
+        emit(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    // mov r64, sign-extended imm32
+    void movImm(int dst, int32_t value) {
+        rex(0, dst);
+        emit(0xC7);
+        emit(0xC0 | (dst & 7));
+        emit32(value);
+    }
+
+    // mov r64, [rdi + disp8] / mov [rdi + disp8], r64
+    void loadSlot(int dst, int slot) {
+        rex(dst, EDI);
+        emit(0x8B);
+        emit(0x40 | (dst & 7) << 3 | EDI);
+        emit(static_cast<uint8_t>(slot * 8));
+    }
+
+    void storeSlot(int src, int slot) {
+        rex(src, EDI);
+        emit(0x89);
+        emit(0x40 | (src & 7) << 3 | EDI);
+        emit(static_cast<uint8_t>(slot * 8));
+    }
+
+    void cmpImm8(int reg, int8_t value) {
+        rex(0, reg);
+        emit(0x83);
+        emit(0xC0 | 7 << 3 | (reg & 7));
+        emit(static_cast<uint8_t>(value));
+    }
+
+    // dst = flags satisfy cc ? 1 : 0
+    void setcc(uint8_t cc, int dst) {
+        emit(0x0F);
+        emit(0x90 | cc);
+        emit(0xC0 | EAX);
+        rex(dst, EAX, false);  // movzx r32, al also clears the upper half
+        emit(0x0F);
+        emit(0xB6);
+        emit(0xC0 | (dst & 7) << 3 | EAX);
+    }
+
+    // Conditional (cc) or unconditional (cc < 0) jump to instruction target
+    void branch(int cc, int target) {
+        if (cc < 0) {
+            emit(0xE9);
+        } else {
+            emit(0x0F);
+            emit(0x80 | cc);
+        }
+        size_t at = bytes.size();
+        emit32(0);
+        if (target >= start && target < end) {
+            internal.push_back({at, target});
+        } else {
+            exits.push_back({at, target});
+        }
+    }
+
+    void patch(size_t at, size_t destination) {
+        int32_t rel = static_cast<int32_t>(destination - (at + 4));
+        std::memcpy(bytes.data() + at, &rel, sizeof(rel));
+    }
+
+    // Write R0-R5 back and return next pc to the interpreter
+    void emitExit(int nextPc) {
+        for (int reg = 0; reg < jitRegisters; ++reg) {
+            storeSlot(hostRegister[reg], reg);
+        }
+        movImm(EAX, nextPc);
+        emit(0xC3);
+    }
+
+    // r1 = r1 <op> r2 for the ALU and compare opcodes the JIT supports
+    void emitAlu(OpCode op, int index, int a, int b) {
+        switch (op) {
+            case OpCode::ADD: aluRR(0x01, a, b); break;
+            case OpCode::SUB: aluRR(0x29, a, b); break;
+            case OpCode::MUL: imulRR(a, b); break;
+            case OpCode::DIV:
+            case OpCode::MOD:
+                aluRR(0x85, b, b);  // test b, b
+                branch(CC_E, -1 - index);
+                cmpImm8(b, -1);
+                branch(CC_E, -1 - index);
+                aluRR(0x89, EAX, a);
+                emit(0x48);
+                emit(0x99);  // cqo
+                rex(0, b);
+                emit(0xF7);
+                emit(0xC0 | 7 << 3 | (b & 7));  // idiv b
+                aluRR(0x89, a, op == OpCode::DIV ? EAX : EDX);
+                break;
+            case OpCode::GT: aluRR(0x39, a, b); setcc(CC_G, a); break;
+            case OpCode::LT: aluRR(0x39, a, b); setcc(CC_L, a); break;
+            case OpCode::EQ: aluRR(0x39, a, b); setcc(CC_E, a); break;
+            default: break;
+        }
+    }
+
+    void emitRegion(const Instruction* code) {
+        for (int reg = 0; reg < jitRegisters; ++reg) {
+            loadSlot(hostRegister[reg], reg);
+        }
+        for (int index = start; index < end; ++index) {
+            const Instruction& ins = code[index];
+            offsets[index - start] = bytes.size();
+            const int a = hostRegister[ins.r1], b = hostRegister[ins.r2], c = hostRegister[ins.r3];
+            switch (ins.op) {
+                case OpCode::MOV: movImm(a, ins.imm); break;
+                case OpCode::JMP: branch(-1, ins.imm); break;
+                case OpCode::JEQ: aluRR(0x39, a, b); branch(CC_E, ins.imm); break;
+                case OpCode::ADDJEQ: emitAlu(OpCode::ADD, index, a, b); aluRR(0x39, a, c); branch(CC_E, ins.imm); break;
+                case OpCode::SUBJEQ: emitAlu(OpCode::SUB, index, a, b); aluRR(0x39, a, c); branch(CC_E, ins.imm); break;
+                case OpCode::GTJEQ: emitAlu(OpCode::GT, index, a, b); aluRR(0x39, a, c); branch(CC_E, ins.imm); break;
+                case OpCode::LTJEQ: emitAlu(OpCode::LT, index, a, b); aluRR(0x39, a, c); branch(CC_E, ins.imm); break;
+                case OpCode::EQJEQ: emitAlu(OpCode::EQ, index, a, b); aluRR(0x39, a, c); branch(CC_E, ins.imm); break;
+                case OpCode::NOP: break;
+                default: emitAlu(ins.op, index, a, b); break;
+            }
+        }
+        emitExit(end);  // Fell off the end of the region
+
+        for (const Patch& jump : internal) {
+            patch(jump.at, offsets[jump.target - start]);
+        }
+        // Exit stubs. Negative targets are bail-outs that resume the
+        // interpreter at instruction -1 - target.
+        for (const Patch& jump : exits) {
+            patch(jump.at, bytes.size());
+            emitExit(jump.target < 0 ? -1 - jump.target : jump.target);
+        }
+    }
+};
+#endif
+
+// One execution context: registers, heap, call stack and program counter,
+// running a shared Program. Contexts are independent, so separate instances
+// can run concurrently on different threads.
+class VirtualMachine {
+public:
+    static constexpr size_t defaultHeapSize = 100;  // Heap cells when no size is given
+    static constexpr size_t defaultCallDepth = 1024;  // Call frames when no depth is given
+    static constexpr uint32_t defaultJitThreshold = 1000;  // Branch hits before a region is compiled
+
+    struct Snapshot;  // Saved execution state, see snapshot()
+
+    // heapSize cells are addressable from the start. ALLOC may grow the heap
+    // up to maxHeapSize cells; 0 keeps it fixed at heapSize.
+    explicit VirtualMachine(size_t heapSize = defaultHeapSize, size_t maxHeapSize = 0)
+        : memory(heapSize, 0), heapLimit(std::max(heapSize, maxHeapSize)) {
+        if (heapSize == 0 || heapLimit > static_cast<size_t>(INT32_MAX)) {
+            throw std::invalid_argument("Heap size must be between 1 and INT32_MAX cells");
+        }
+        // Initialize registers to 0
+        std::fill(std::begin(registers), std::end(registers), 0);
+        pc = 0;
+        running = false;
+        frames.resize(defaultCallDepth);
+        savedRegisters.resize(defaultCallDepth * registerCount);
+    }
+
+    explicit VirtualMachine(std::shared_ptr<const Program> shared, size_t heapSize = defaultHeapSize,
+                            size_t maxHeapSize = 0)
+        : VirtualMachine(heapSize, maxHeapSize) {
+        attach(std::move(shared));
+    }
+
+    VirtualMachine(const VirtualMachine&) = delete;
+    VirtualMachine& operator=(const VirtualMachine&) = delete;
+
+    // Return the VM to its initial state so it can run another job: clears
+    // registers and the call stack, releases every ALLOC and zeroes the heap.
+    // The loaded program and the current heap capacity are kept.
+    void reset() {
+        std::fill(std::begin(registers), std::end(registers), 0);
+        std::fill(std::begin(vectors), std::end(vectors), VectorRegister{});
+        depth = 0;
+        savedTop = 0;
+        std::fill(memory.begin(), memory.end(), 0);
+        heapTop = 0;
+        pc = 0;
+        running = false;
+    }
+
+    // Capture registers, heap, call stack, pc and program so that restore()
+    // can put this or any other context back into exactly this state, e.g.
+    // after a shared setup phase. The snapshot is immutable and can seed
+    // contexts on any thread.
+    std::shared_ptr<const Snapshot> snapshot() const;
+
+    // Replace this context's state with a snapshot. Costs one copy of the
+    // heap and the live frames, independent of how long it took to build
+    // that state. Heap capacity and depth limit must be large enough.
+    void restore(const Snapshot& saved);
+
+    // Choose whether scalar arithmetic wraps or stops on overflow (default
+    // Wrap). The JIT stays off under Trap, since its native code wraps.
+    void setOverflowMode(OverflowMode mode) {
+        overflowMode = mode;
+    }
+
+    // Limit the number of nested CALLs. All frames are allocated up front,
+    // with room for each to save a full register window, so CALL and RET
+    // never allocate.
+    void setMaxCallDepth(size_t maxDepth) {
+        if (maxDepth == 0 || maxDepth > static_cast<size_t>(INT32_MAX)) {
+            throw std::invalid_argument("Call depth must be between 1 and INT32_MAX");
+        }
+        frames.assign(maxDepth, CallFrame{});
+        savedRegisters.assign(maxDepth * registerCount, 0);
+        depth = 0;
+        savedTop = 0;
+    }
+
+    // Assemble text bytecode into a new program for this VM
+    void load(const std::vector<std::string>& bytecode) {
+        auto assembled = std::make_shared<Program>();
+        assembled->load(bytecode);
+        attach(std::move(assembled));
+    }
+
+    // Map a binary bytecode file into a new program for this VM
+    void loadBinary(const std::string& path) {
+        auto mapped = std::make_shared<Program>();
+        mapped->loadBinary(path);
+        attach(std::move(mapped));
+    }
+
+    // Execute a shared program in this context
+    void attach(std::shared_ptr<const Program> shared) {
+        program = std::move(shared);
+        jitEntries.clear();
+        jitCode.clear();
+    }
+
+    // Tiered execution: count how often each branch target is reached and
+    // compile it to native code once it has been hit threshold times. Has no
+    // effect on builds without a JIT backend.
+    void setTiered(bool enabled, uint32_t threshold = defaultJitThreshold) {
+        tiered = enabled && VM_JIT;
+        jitThreshold = std::max(1u, threshold);
+    }
+
+    // Counters from the last run (all zero unless built with VM_PROFILE)
+    const Profile& profile() const {
+        return stats;
+    }
+
+    // After each run, write the profile as JSON to path and as folded stacks
+    // to path + ".folded". Ignored unless built with VM_PROFILE.
+    void setProfileOutput(const std::string& path) {
+        profilePath = path;
+    }
+
+    // Number of regions compiled to native code so far
+    size_t compiledRegions() const {
+        return jitCode.size();
+    }
+
+    // Write the loaded program as a binary bytecode file
+    void save(const std::string& path) const {
+        requireProgram().save(path);
+    }
+
+    int64_t getRegister(int reg) const {
+        return registers[checkRegister(reg)];
+    }
+
+    void setRegister(int reg, int64_t value) {
+        registers[checkRegister(reg)] = value;
+    }
+
+    // Heap cell at address, e.g. to read results after a run
+    int32_t getMemory(int64_t address) const {
+        if (!inHeap(address, 1)) {
+            throw std::out_of_range("Invalid heap address " + std::to_string(address));
+        }
+        return memory[address];
+    }
+
+    // Send PRINT output to sink instead of stdout. The sink must outlive
+    // the VM or be replaced first; it is flushed at the end of every run.
+    void setOutput(OutputSink& sink) {
+        output = &sink;
+    }
+
+    // Run the decoded program from the start, reporting a trap on stderr
+    void run() {
+        if (start() != Trap::None) {
+            std::cerr << "Error: " << trapMessage(trap) << std::endl;
+        }
+    }
+
+    // Run from the start and throw TrapError if the program traps
+    void runOrThrow() {
+        if (start() != Trap::None) {
+            throw TrapError(trap, pc);
+        }
+    }
+
+    // Run from the start until the program ends or traps. On a trap, pc
+    // is left on the faulting instruction and every other piece of state is
+    // as it was just before it, so the caller can inspect it, fix it up and
+    // resume().
+    Trap start() {
+        pc = 0;  // Reset program counter
+        return resume();
+    }
+
+    // Continue from the current pc
+    Trap resume() {
+        const Program& current = requireProgram();
+        trap = Trap::None;
+        running = true;
+#if VM_PROFILE
+        profileStart();
+#endif
+        if (pc < 0 || pc > current.size()) {
+            trap = Trap::InvalidAddress;
+        } else {
+            dispatch();
+        }
+        output->flush();
+        running = false;
+#if VM_PROFILE
+        profileFinish();
+#endif
+        return trap;
+    }
+
+    // Trap that stopped the last run, Trap::None if it completed
+    Trap lastTrap() const {
+        return trap;
+    }
+
+    int getPc() const {
+        return pc;
+    }
+
+    // Move execution to instruction index target, e.g. to skip a faulting
+    // instruction before resume()
+    void setPc(int target) {
+        if (target < 0 || target > requireProgram().size()) {
+            throw std::out_of_range("Invalid pc " + std::to_string(target));
+        }
+        pc = target;
+    }
+
+private:
+    std::unique_ptr<OutputSink> standardOutput = std::make_unique<FileDescriptorSink>();  // Default sink
+    OutputSink* output = standardOutput.get();  // Where PRINT writes
+    int64_t registers[registerCount];  // Registers R0 to R<registerCount - 1>
+    VectorRegister vectors[vectorRegisterCount] = {};  // Vector registers V0 to V7
+    std::vector<int> memory;  // Heap memory; STORE keeps the low 32 bits of a register
+    size_t heapLimit;  // Largest size the heap may grow to
+    size_t heapTop = 0;  // Bump pointer: first cell not handed out by ALLOC
+    std::shared_ptr<const Program> program;  // Program being executed
+    int pc;  // Program counter
+    bool running;  // VM running status
+    Trap trap = Trap::None;  // Why the last run stopped
+    OverflowMode overflowMode = OverflowMode::Wrap;  // Scalar arithmetic overflow behaviour
+
+    // Activation record pushed by CALL
+    struct CallFrame {
+        int returnPc;    // Instruction after the CALL
+        uint8_t first;   // First register of the saved window
+        uint16_t count;  // Number of saved registers
+        size_t saved;    // Where the window starts in savedRegisters
+    };
+
+    std::vector<CallFrame> frames;  // Preallocated call stack, size is the depth limit
+    size_t depth = 0;  // Frames in use
+    std::vector<int64_t> savedRegisters;  // Register windows of the active frames, registerCount per frame
+    size_t savedTop = 0;  // Entries of savedRegisters in use
+
+    Profile stats;  // Filled in by profiling builds
+    std::string profilePath;  // Where run() writes the profile, if set
+#if VM_PROFILE
+    uint64_t lastClock = 0;  // Clock reading when the current instruction started
+    size_t lastOp = opcodeKinds;  // Opcode being timed, opcodeKinds before the first
+    size_t lastPc = 0;  // Index of the instruction being timed
+    int stackNode = 0;  // Current node in stats.stacks
+    std::vector<int> stackPath;  // Caller nodes of the active frames
+    std::unordered_map<uint64_t, int> stackIndex;  // (parent, callee) -> node
+
+    void profileStart() {
+        const size_t size = static_cast<size_t>(requireProgram().size());
+        stats = Profile();
+        stats.pcHits.assign(size, 0);
+        stats.branchTaken.assign(size, 0);
+        stats.branchNotTaken.assign(size, 0);
+        stackNode = 0;
+        stackPath.clear();
+        stackIndex.clear();
+        lastOp = opcodeKinds;
+        lastClock = profileClock();
+    }
+
+    // Charge the time since the previous step to the previous instruction
+    void profileStep(const Instruction& instruction, size_t index) {
+        uint64_t now = profileClock();
+        if (lastOp != opcodeKinds) {
+            stats.opcodeCycles[lastOp] += now - lastClock;
+            stats.stackCycles[stackNode] += now - lastClock;
+        }
+        lastClock = now;
+        lastOp = static_cast<size_t>(instruction.op);
+        lastPc = index;
+        ++stats.opcodeCount[lastOp];
+        ++stats.pcHits[index];
+    }
+
+    void profileBranch(bool taken) {
+        ++(taken ? stats.branchTaken : stats.branchNotTaken)[lastPc];
+    }
+
+    void profileCall(int target) {
+        stats.maxCallDepth = std::max(stats.maxCallDepth, depth);
+        const uint64_t key = uint64_t(uint32_t(stackNode)) << 32 | uint32_t(target);
+        auto found = stackIndex.find(key);
+        if (found == stackIndex.end()) {
+            found = stackIndex.emplace(key, static_cast<int>(stats.stacks.size())).first;
+            stats.stacks.emplace_back(stackNode, target);
+            stats.stackCycles.push_back(0);
+        }
+        stackPath.push_back(stackNode);
+        stackNode = found->second;
+    }
+
+    void profileReturn() {
+        if (!stackPath.empty()) {
+            stackNode = stackPath.back();
+            stackPath.pop_back();
+        }
+    }
+
+    void profileFinish() {
+        profileStep(Instruction{OpCode::NOP, 0, 0, 0, 0}, 0);
+        --stats.opcodeCount[static_cast<size_t>(OpCode::NOP)];  // Undo the flush step
+        --stats.pcHits[0];
+        if (profilePath.empty()) {
+            return;
+        }
+        std::ofstream json(profilePath);
+        stats.writeJson(json, requireProgram().symbols());
+        std::ofstream folded(profilePath + ".folded");
+        stats.writeFolded(folded, requireProgram().symbols());
+        if (!json || !folded) {
+            std::cerr << "Error: Cannot write profile " << profilePath << std::endl;
+        }
+    }
+#endif
+
+    // Per-instruction tier-up state, only allocated in tiered mode
+    struct JitEntry {
+        JitFunction native = nullptr;  // Compiled region starting here
+        uint32_t hits = 0;  // Times reached by a taken branch
+        bool rejected = false;  // Cannot be compiled
+    };
+
+    bool tiered = false;  // Tiered (interpreter + JIT) execution enabled
+    uint32_t jitThreshold = defaultJitThreshold;
+    std::vector<JitEntry> jitEntries;
+#if VM_JIT
+    std::vector<std::unique_ptr<ExecutableMemory>> jitCode;  // Owns compiled regions
+#else
+    std::vector<int> jitCode;  // Always empty without a JIT backend
+#endif
+
+    // Called after a taken branch has set pc. Runs compiled regions for as
+    // long as execution keeps landing on them, counting hits on the rest.
+    void tierUp(const Instruction* code, int size) {
+#if VM_JIT
+        if (overflowMode == OverflowMode::Trap) {
+            return;  // Compiled regions wrap instead of trapping
+        }
+        if (jitEntries.size() != static_cast<size_t>(size)) {
+            jitEntries.assign(size, JitEntry{});
+        }
+        while (pc < size) {
+            JitEntry& entry = jitEntries[pc];
+            if (!entry.native) {
+                if (entry.rejected || ++entry.hits < jitThreshold) {
+                    return;
+                }
+                std::unique_ptr<ExecutableMemory> region;
+                try {
+                    region = JitCompiler::compile(code, size, pc);
+                } catch (const std::exception&) {
+                    // No executable memory: stay in the interpreter
+                }
+                if (!region) {
+                    entry.rejected = true;
+                    return;
+                }
+                entry.native = region->entry();
+                jitCode.push_back(std::move(region));
+            }
+            int entered = pc;
+            pc = entry.native(registers);
+            if (pc == entered) {
+                return;  // Bailed out on its first instruction; let the interpreter handle it
+            }
+        }
+#else
+        (void)code;
+        (void)size;
+#endif
+    }
+
+    const Program& requireProgram() const {
+        if (!program) {
+            throw std::logic_error("No program loaded");
+        }
+        return *program;
+    }
+
+    static int checkRegister(int reg) {
+        if (reg < 0 || reg >= registerCount) {
+            throw std::out_of_range("Invalid register R" + std::to_string(reg));
+        }
+        return reg;
+    }
+
+    // Interpreter loop. With VM_THREADED_DISPATCH every handler jumps straight
+    // to the next one through a label table, otherwise a switch is used.
+    void dispatch() {
+        const Instruction* const code = requireProgram().instructions();
+        const int size = requireProgram().size();
+        const int64_t* const constants = requireProgram().constantPool();
+        const Instruction* ins;
+
+// Record a trap on the current instruction and leave the loop
+#define VM_TRAP(kind)                                               \
+        do {                                                        \
+            trap = (kind);                                          \
+            pc -= 1;                                                \
+            return;                                                 \
+        } while (0)
+
+#if VM_PROFILE
+#define VM_PROFILE_STEP() profileStep(*ins, pc - 1)
+#define VM_PROFILE_BRANCH(taken) profileBranch(taken)
+#define VM_PROFILE_CALL(target) profileCall(target)
+#define VM_PROFILE_RETURN() profileReturn()
+#else
+#define VM_PROFILE_STEP() ((void)0)
+#define VM_PROFILE_BRANCH(taken) ((void)0)
+#define VM_PROFILE_CALL(target) ((void)0)
+#define VM_PROFILE_RETURN() ((void)0)
+#endif
+
+#if VM_THREADED_DISPATCH
+        // Indexed by OpCode, keep in declaration order
+        static void* const handlers[] = {
+            &&op_MOV, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_MOD, &&op_EXP,
+            &&op_GT, &&op_LT, &&op_EQ,
+            &&op_PRINT, &&op_JMP, &&op_JEQ, &&op_CALL, &&op_RET,
+            &&op_ALLOC, &&op_STORE, &&op_LOAD, &&op_STOREX, &&op_LOADX, &&op_MEMCPY, &&op_MEMSET,
+            &&op_VADD, &&op_VSUB, &&op_VMUL, &&op_VCMP, &&op_VLOAD, &&op_VSTORE,
+            &&op_MULADD, &&op_MODEXP,
+            &&op_ADDJEQ, &&op_SUBJEQ, &&op_GTJEQ, &&op_LTJEQ, &&op_EQJEQ,
+            &&op_MOVC,
+            &&op_NOP
+        };
+#define VM_CASE(name) op_##name
+#define VM_NEXT()                                                   \
+        do {                                                        \
+            if (pc >= size) return;                                 \
+            ins = &code[pc++];                                      \
+            VM_PROFILE_STEP();                                      \
+            goto *handlers[static_cast<uint8_t>(ins->op)];          \
+        } while (0)
+
+        VM_NEXT();
+#else
+#define VM_CASE(name) case OpCode::name
+#define VM_NEXT() continue
+#endif
+#define VM_BRANCH(target)                                           \
+        do {                                                        \
+            pc = (target);                                          \
+            if (tiered) tierUp(code, size);                         \
+        } while (0)
+
+#if !VM_THREADED_DISPATCH
+
+        while (pc < size) {
+            ins = &code[pc++];
+            VM_PROFILE_STEP();
+            switch (ins->op) {
+#endif
+            VM_CASE(MOV):
+                registers[ins->r1] = ins->imm;
+                VM_NEXT();
+            VM_CASE(ADD): {
+                int64_t result;
+                if (addOverflow(registers[ins->r1], registers[ins->r2], result) && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                VM_NEXT();
+            }
+            VM_CASE(SUB): {
+                int64_t result;
+                if (subOverflow(registers[ins->r1], registers[ins->r2], result) && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                VM_NEXT();
+            }
+            VM_CASE(MUL): {
+                int64_t result;
+                if (mulOverflow(registers[ins->r1], registers[ins->r2], result) && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                VM_NEXT();
+            }
+            VM_CASE(DIV): {
+                const int64_t divisor = registers[ins->r2];
+                if (divisor == 0) {
+                    VM_TRAP(Trap::DivisionByZero);
+                }
+                if (divisor == -1) {
+                    // Negate without the hardware fault on INT64_MIN / -1,
+                    // which wraps to INT64_MIN
+                    if (registers[ins->r1] == INT64_MIN && overflowMode == OverflowMode::Trap) {
+                        VM_TRAP(Trap::IntegerOverflow);
+                    }
+                    registers[ins->r1] = static_cast<int64_t>(0 - static_cast<uint64_t>(registers[ins->r1]));
+                } else {
+                    registers[ins->r1] /= divisor;
+                }
+                VM_NEXT();
+            }
+            VM_CASE(MOD): {
+                const int64_t divisor = registers[ins->r2];
+                if (divisor == 0) {
+                    VM_TRAP(Trap::ModulusByZero);
+                }
+                registers[ins->r1] = divisor == -1 ? 0 : registers[ins->r1] % divisor;
+                VM_NEXT();
+            }
+            VM_CASE(EXP): {
+                bool overflow;
+                int64_t result = integerPower(registers[ins->r1], registers[ins->r2], overflow);
+                if (overflow && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                VM_NEXT();
+            }
+            VM_CASE(GT):
+                registers[ins->r1] = registers[ins->r1] > registers[ins->r2] ? 1 : 0;
+                VM_NEXT();
+            VM_CASE(LT):
+                registers[ins->r1] = registers[ins->r1] < registers[ins->r2] ? 1 : 0;
+                VM_NEXT();
+            VM_CASE(EQ):
+                registers[ins->r1] = registers[ins->r1] == registers[ins->r2] ? 1 : 0;
+                VM_NEXT();
+            VM_CASE(PRINT):
+                print(*ins);
+                VM_NEXT();
+            VM_CASE(JMP):
+                VM_BRANCH(ins->imm);
+                VM_NEXT();
+            VM_CASE(JEQ): {
+                bool taken = registers[ins->r1] == registers[ins->r2];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(CALL): {
+                if (depth == frames.size()) {
+                    VM_TRAP(Trap::CallStackOverflow);
+                }
+                CallFrame& frame = frames[depth++];
+                frame.returnPc = pc;
+                frame.first = ins->r1;
+                frame.count = ins->r3 ? static_cast<uint16_t>(ins->r2 - ins->r1 + 1) : 0;
+                frame.saved = savedTop;
+                if (frame.count != 0) {
+                    std::copy_n(registers + frame.first, frame.count, savedRegisters.data() + savedTop);
+                    savedTop += frame.count;
+                }
+                pc = ins->imm;
+                VM_PROFILE_CALL(ins->imm);
+                VM_NEXT();
+            }
+            VM_CASE(RET): {
+                if (depth == 0) {
+                    VM_TRAP(Trap::EmptyCallStack);
+                }
+                const CallFrame& frame = frames[--depth];
+                std::copy_n(savedRegisters.data() + frame.saved, frame.count, registers + frame.first);
+                savedTop = frame.saved;
+                pc = frame.returnPc;
+                VM_PROFILE_RETURN();
+                VM_NEXT();
+            }
+            VM_CASE(ALLOC):
+                if (!alloc(*ins)) {
+                    VM_TRAP(Trap::OutOfMemory);
+                }
+                VM_NEXT();
+            VM_CASE(STORE):
+                if (!inHeap(ins->imm, 1)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                memory[ins->imm] = static_cast<int32_t>(registers[ins->r1]);
+                VM_NEXT();
+            VM_CASE(LOAD):
+                if (!inHeap(ins->imm, 1)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                registers[ins->r1] = memory[ins->imm];
+                VM_NEXT();
+            VM_CASE(STOREX): {
+                int64_t addr = effectiveAddress(*ins);
+                if (!inHeap(addr, 1)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                memory[addr] = static_cast<int32_t>(registers[ins->r1]);
+                VM_NEXT();
+            }
+            VM_CASE(LOADX): {
+                int64_t addr = effectiveAddress(*ins);
+                if (!inHeap(addr, 1)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                registers[ins->r1] = memory[addr];
+                VM_NEXT();
+            }
+            VM_CASE(MEMCPY):
+                if (!inHeap(registers[ins->r1], registers[ins->r3]) ||
+                    !inHeap(registers[ins->r2], registers[ins->r3])) {
+                    VM_TRAP(Trap::InvalidRange);
+                }
+                std::memmove(memory.data() + registers[ins->r1], memory.data() + registers[ins->r2],
+                             registers[ins->r3] * sizeof(int));
+                VM_NEXT();
+            VM_CASE(MEMSET):
+                if (!inHeap(registers[ins->r1], registers[ins->r3])) {
+                    VM_TRAP(Trap::InvalidRange);
+                }
+                std::fill_n(memory.begin() + registers[ins->r1], registers[ins->r3],
+                            static_cast<int32_t>(registers[ins->r2]));
+                VM_NEXT();
+            VM_CASE(VADD):
+                vectorKernel<VectorOp::Add>(vectors[ins->r1], vectors[ins->r2]);
+                VM_NEXT();
+            VM_CASE(VSUB):
+                vectorKernel<VectorOp::Sub>(vectors[ins->r1], vectors[ins->r2]);
+                VM_NEXT();
+            VM_CASE(VMUL):
+                vectorKernel<VectorOp::Mul>(vectors[ins->r1], vectors[ins->r2]);
+                VM_NEXT();
+            VM_CASE(VCMP):
+                vectorKernel<VectorOp::CmpEq>(vectors[ins->r1], vectors[ins->r2]);
+                VM_NEXT();
+            VM_CASE(VLOAD): {
+                int64_t addr = effectiveAddress(*ins);
+                if (!inHeap(addr, vectorLanes)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                std::memcpy(vectors[ins->r1].lanes, memory.data() + addr, sizeof(VectorRegister));
+                VM_NEXT();
+            }
+            VM_CASE(VSTORE): {
+                int64_t addr = effectiveAddress(*ins);
+                if (!inHeap(addr, vectorLanes)) {
+                    VM_TRAP(Trap::InvalidAddress);
+                }
+                std::memcpy(memory.data() + addr, vectors[ins->r1].lanes, sizeof(VectorRegister));
+                VM_NEXT();
+            }
+            VM_CASE(MULADD): {
+                int64_t product, sum;
+                bool overflow = mulOverflow(registers[ins->r2], registers[ins->r3], product);
+                overflow |= addOverflow(registers[ins->r1], product, sum);
+                if (overflow && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = sum;
+                VM_NEXT();
+            }
+            VM_CASE(MODEXP):
+                if (registers[ins->r3] <= 0) {
+                    VM_TRAP(Trap::InvalidModulus);
+                }
+                if (registers[ins->r2] < 0) {
+                    VM_TRAP(Trap::NegativeExponent);
+                }
+                registers[ins->r1] = modularPower(registers[ins->r1], registers[ins->r2], registers[ins->r3]);
+                VM_NEXT();
+            VM_CASE(ADDJEQ): {
+                int64_t result;
+                if (addOverflow(registers[ins->r1], registers[ins->r2], result) && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                bool taken = registers[ins->r1] == registers[ins->r3];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(SUBJEQ): {
+                int64_t result;
+                if (subOverflow(registers[ins->r1], registers[ins->r2], result) && overflowMode == OverflowMode::Trap) {
+                    VM_TRAP(Trap::IntegerOverflow);
+                }
+                registers[ins->r1] = result;
+                bool taken = registers[ins->r1] == registers[ins->r3];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(GTJEQ): {
+                registers[ins->r1] = registers[ins->r1] > registers[ins->r2] ? 1 : 0;
+                bool taken = registers[ins->r1] == registers[ins->r3];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(LTJEQ): {
+                registers[ins->r1] = registers[ins->r1] < registers[ins->r2] ? 1 : 0;
+                bool taken = registers[ins->r1] == registers[ins->r3];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(EQJEQ): {
+                registers[ins->r1] = registers[ins->r1] == registers[ins->r2] ? 1 : 0;
+                bool taken = registers[ins->r1] == registers[ins->r3];
+                VM_PROFILE_BRANCH(taken);
+                if (taken) {
+                    VM_BRANCH(ins->imm);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(MOVC):
+                registers[ins->r1] = constants[ins->imm];
+                VM_NEXT();
+            VM_CASE(NOP):
+                VM_NEXT();
+#if !VM_THREADED_DISPATCH
+            }
+        }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_BRANCH
+#undef VM_TRAP
+#undef VM_PROFILE_STEP
+#undef VM_PROFILE_BRANCH
+#undef VM_PROFILE_CALL
+#undef VM_PROFILE_RETURN
+    }
+
+    void print(const Instruction& instruction) {
+        int reg = instruction.r1;
+        output->write("Register ", 9);
+        output->writeInt(reg);
+        output->write(": ", 2);
+        output->writeInt(registers[reg]);
+        output->put('\n');
+    }
+
+    // Bump allocation: hand out the next size cells and return their base
+    // address in r1, growing the heap geometrically when it runs out. Returns
+    // false when the heap limit would be exceeded.
+    bool alloc(const Instruction& instruction) {
+        size_t size = static_cast<size_t>(instruction.imm);
+        if (size > heapLimit - heapTop) {
+            return false;
+        }
+        if (heapTop + size > memory.size()) {
+            memory.resize(std::min(heapLimit, std::max(heapTop + size, memory.size() * 2)), 0);
+        }
+        registers[instruction.r1] = static_cast<int64_t>(heapTop);
+        heapTop += size;
+        return true;
+    }
+
+    // Whether cells [start, start + count) lie inside the heap
+    bool inHeap(int64_t start, int64_t count) const {
+        const int64_t size = static_cast<int64_t>(memory.size());
+        return start >= 0 && count >= 0 && count <= size && start <= size - count;
+    }
+
+    // Base register plus offset of a LOADX/STOREX/VLOAD/VSTORE
+    int64_t effectiveAddress(const Instruction& instruction) const {
+        return registers[instruction.r2] + instruction.imm;
+    }
+};
+
+struct VirtualMachine::Snapshot {
+    std::shared_ptr<const Program> program;  // Program the state belongs to
+    int64_t registers[registerCount];  // Scalar registers
+    VectorRegister vectors[vectorRegisterCount];  // Vector registers
+    std::vector<int> memory;  // Whole heap
+    size_t heapTop;  // ALLOC bump pointer
+    std::vector<CallFrame> frames;  // Active frames only
+    std::vector<int64_t> savedRegisters;  // Their saved windows
+    int pc;  // Where resume() continues
+};
+
+inline std::shared_ptr<const VirtualMachine::Snapshot> VirtualMachine::snapshot() const {
+    auto saved = std::make_shared<Snapshot>();
+    saved->program = program;
+    std::copy(std::begin(registers), std::end(registers), saved->registers);
+    std::copy(std::begin(vectors), std::end(vectors), saved->vectors);
+    saved->memory = memory;
+    saved->heapTop = heapTop;
+    saved->frames.assign(frames.begin(), frames.begin() + depth);
+    saved->savedRegisters.assign(savedRegisters.begin(), savedRegisters.begin() + savedTop);
+    saved->pc = pc;
+    return saved;
+}
+
+inline void VirtualMachine::restore(const Snapshot& saved) {
+    if (saved.memory.size() > heapLimit) {
+        throw std::invalid_argument("Snapshot heap exceeds the heap limit of this context");
+    }
+    if (saved.frames.size() > frames.size()) {
+        throw std::invalid_argument("Snapshot call stack exceeds the depth limit of this context");
+    }
+    if (program != saved.program) {
+        attach(saved.program);  // Same program keeps its compiled regions
+    }
+    std::copy(std::begin(saved.registers), std::end(saved.registers), registers);
+    std::copy(std::begin(saved.vectors), std::end(saved.vectors), vectors);
+    memory.assign(saved.memory.begin(), saved.memory.end());  // Reuses capacity, plain memmove
+    heapTop = saved.heapTop;
+    std::copy(saved.frames.begin(), saved.frames.end(), frames.begin());
+    depth = saved.frames.size();
+    std::copy(saved.savedRegisters.begin(), saved.savedRegisters.end(), savedRegisters.begin());
+    savedTop = saved.savedRegisters.size();
+    pc = saved.pc;
+    trap = Trap::None;
+    running = false;
+}
+
+// Fixed-size thread pool with one task deque per worker. Workers take their
+// own newest task first and steal the oldest task from other workers when
+// they run dry, so uneven batches still keep every core busy.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threads = std::thread::hardware_concurrency()) {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<TaskQueue>());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(stateLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    // Queue a task, spreading submissions round-robin over the workers. The
+    // counters go up before the task is visible, so a worker that takes it
+    // at once cannot bring pending to zero while wait() is watching.
+    void submit(std::function<void()> task) {
+        TaskQueue& queue = *queues[nextQueue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> guard(stateLock);
+            ++queued;
+            ++pending;
+        }
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished. Rethrows the first
+    // exception a task raised since the last wait().
+    void wait() {
+        std::unique_lock<std::mutex> guard(stateLock);
+        idle.wait(guard, [this] { return pending == 0; });
+        if (failure) {
+            std::exception_ptr error = failure;
+            failure = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> queues;  // One deque per worker
+    std::vector<std::thread> workers;
+    std::atomic<size_t> nextQueue{0};  // Round-robin submission cursor
+    std::mutex stateLock;  // Guards the counters below
+    std::condition_variable wake;  // Signalled when work arrives or on shutdown
+    std::condition_variable idle;  // Signalled when pending drops to zero
+    size_t queued = 0;  // Tasks sitting in a deque
+    size_t pending = 0;  // Tasks submitted but not yet finished
+    bool stopping = false;
+    std::exception_ptr failure;  // First exception thrown by a task
+
+    bool take(unsigned self, std::function<void()>& task) {
+        {
+            TaskQueue& own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            TaskQueue& victim = *queues[(self + offset) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned self) {
+        while (true) {
+            std::function<void()> task;
+            if (take(self, task)) {
+                {
+                    std::lock_guard<std::mutex> guard(stateLock);
+                    --queued;
+                }
+                std::exception_ptr error;
+                try {
+                    task();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> guard(stateLock);
+                if (error && !failure) {
+                    failure = error;
+                }
+                if (--pending == 0) {
+                    idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(stateLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+};
+
+// Run count independent executions of a shared program on the pool. Jobs are
+// grouped into batches that each reuse one context, reset() between jobs.
+// With a warm snapshot every job instead starts from that state (restored,
+// then program run from its start) so a shared setup phase runs only once;
+// each context keeps the regions it compiled from one job to the next.
+// prepare(vm, job) runs before each execution (e.g. to seed registers) and
+// collect(vm, job) after it; either may be empty.
+inline void runBatch(WorkerPool& pool, const std::shared_ptr<const Program>& program, size_t count,
+                     const std::function<void(VirtualMachine&, size_t)>& prepare,
+                     const std::function<void(VirtualMachine&, size_t)>& collect,
+                     size_t heapSize = VirtualMachine::defaultHeapSize,
+                     const std::shared_ptr<const VirtualMachine::Snapshot>& warm = nullptr) {
+    std::shared_ptr<const VirtualMachine::Snapshot> start = warm;
+    if (warm) {
+        heapSize = std::max(heapSize, warm->memory.size());
+        if (warm->program != program) {
+            // Rebind once, so restore() never attaches another program
+            auto rebound = std::make_shared<VirtualMachine::Snapshot>(*warm);
+            rebound->program = program;
+            start = std::move(rebound);
+        }
+    }
+    const size_t chunk = std::max<size_t>(1, count / (size_t(pool.size()) * 8));
+    for (size_t first = 0; first < count; first += chunk) {
+        const size_t last = std::min(count, first + chunk);
+        pool.submit([&, first, last] {
+            VirtualMachine vm(program, heapSize);
+            for (size_t job = first; job < last; ++job) {
+                if (start) {
+                    vm.restore(*start);
+                } else if (job != first) {
+                    vm.reset();
+                }
+                if (prepare) prepare(vm, job);
+                vm.run();
+                if (collect) collect(vm, job);
+            }
+        });
+    }
+    pool.wait();
+}
+
+// Read a text bytecode file, one instruction or label per line
+inline std::vector<std::string> readSource(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// Binary bytecode files start with the format magic
+inline bool isBinaryFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(bytecodeMagic)] = {};
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, bytecodeMagic, sizeof(magic)) == 0;
+}
+
+// Load a text or binary program from disk, optionally optimised
+inline std::shared_ptr<Program> loadProgram(const std::string& path, bool optimize) {
+    auto program = std::make_shared<Program>();
+    if (isBinaryFile(path)) {
+        program->loadBinary(path);
+    } else {
+        program->load(readSource(path));
+    }
+    if (optimize) {
+        program->optimize();
+    }
+    return program;
+}
+
+#endif  // VIRTUAL_MACHINE_H